@@ -1,10 +1,38 @@
+#include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <GL/glu.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <zlib.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
 enum DisplayMode {
     WIREFRAME,
     FILLED
@@ -23,194 +51,4064 @@ double lastMouseX, lastMouseY;
 std::vector<std::string> transformations;
 int currentTransformationIndex = -1;
 
+// Alocador com alinhamento de linha de cache, para buffers lidos em sequencia
+// pelas passadas de normais e de transformacao.
+template <typename T>
+struct AlignedAllocator {
+    using value_type = T;
+    static const size_t alignment = 64;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(alignment)));
+    }
+    void deallocate(T* pointer, size_t) {
+        ::operator delete(pointer, std::align_val_t(alignment));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) {
+    return false;
+}
+
+using AlignedFloats = std::vector<float, AlignedAllocator<float>>;
+
 struct Vertex {
     float x, y, z;
 };
 
-struct Face {
+struct Triangle {
     int v1, v2, v3;
-    float normal[3];
 };
 
+// Matriz 4x4 em ordem de coluna, como o OpenGL espera.
+struct Matrix4 {
+    GLfloat m[16];
+};
+
+Matrix4 identityMatrix() {
+    return {{1.0f, 0.0f, 0.0f, 0.0f,
+             0.0f, 1.0f, 0.0f, 0.0f,
+             0.0f, 0.0f, 1.0f, 0.0f,
+             0.0f, 0.0f, 0.0f, 1.0f}};
+}
+
+// a * b, equivalente a carregar a e chamar glMultMatrixf(b).
+Matrix4 multiplyMatrix(const Matrix4& a, const Matrix4& b) {
+    Matrix4 result;
+    for (int column = 0; column < 4; ++column) {
+        for (int row = 0; row < 4; ++row) {
+            result.m[column * 4 + row] = a.m[row] * b.m[column * 4] + a.m[4 + row] * b.m[column * 4 + 1] +
+                                         a.m[8 + row] * b.m[column * 4 + 2] + a.m[12 + row] * b.m[column * 4 + 3];
+        }
+    }
+    return result;
+}
+
 std::vector<Vertex> vertices;
-std::vector<Face> faces;
-std::vector<std::vector<float>> vertexNormals;
+// Faces do .obj em formato CSR: os indices da face i ficam em
+// faceIndices[faceOffsets[i]] ate faceIndices[faceOffsets[i + 1] - 1].
+std::vector<uint32_t> faceOffsets;
+std::vector<int> faceIndices;
+// Atributos do .obj como lidos (vt com 2 floats, vn com 3) e, por canto de face,
+// os indices para eles (-1 quando o canto nao tem o atributo). Sao consumidos
+// por deindexAttributes().
+std::vector<float> objTexcoords;
+std::vector<float> objNormals;
+std::vector<int> faceTexcoordIndices;
+std::vector<int> faceNormalIndices;
+// Coordenadas de textura por vertice (2 floats), se o arquivo tiver vt.
+std::vector<float> vertexTexcoords;
+// true quando vertexNormals veio das normais vn do arquivo.
+bool authoredNormals = false;
+// Faces trianguladas em leque, com uma normal (3 floats) por triangulo.
+std::vector<Triangle> triangles;
+AlignedFloats triangleNormals;
+// Normais por vertice, 3 floats seguidos por vertice.
+AlignedFloats vertexNormals;
+// Adjacencia vertice -> triangulos em CSR: os triangulos que usam o vertice v
+// ficam em vertexTriangles[vertexTriangleOffsets[v]] ate
+// vertexTriangles[vertexTriangleOffsets[v + 1] - 1], em ordem crescente.
+std::vector<uint32_t> vertexTriangleOffsets;
+std::vector<uint32_t> vertexTriangles;
+// Arestas unicas dos triangulos, em pares (a, b) com a < b, agrupadas por
+// cluster depois de buildMeshClusters().
+std::vector<uint32_t> edgeIndices;
+// Incrementado sempre que posicoes, normais ou triangulos mudam; os buffers da
+// GPU sao reenviados quando a versao enviada fica para tras.
+uint64_t geometryVersion = 1;
 
-std::vector<Vertex> transformedVertices;
-std::vector<Face> transformedFaces;
-std::vector<Vertex> previousTransformedVertices;
-std::vector<Face> previousTransformedFaces;
+// Pool fixo de threads; a thread que chama run() tambem executa tarefas.
+// Chamadas a run() nao podem ser aninhadas.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned workerCount) {
+        for (unsigned i = 0; i < workerCount; ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
 
-bool loadOBJ(const char* path) {
-    std::ifstream file(path);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << path << std::endl;
-        return false;
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
     }
 
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string type;
-        iss >> type;
+    unsigned size() const {
+        return static_cast<unsigned>(workers.size()) + 1;
+    }
+
+    // Executa task(i) para i em [0, count) com no maximo maxThreads threads (0 = todas).
+    void run(size_t count, const std::function<void(size_t)>& task, unsigned maxThreads = 0) {
+        if (count == 0) {
+            return;
+        }
+        unsigned threads = maxThreads == 0 ? size() : std::min(maxThreads, size());
+        threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+        if (threads <= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                task(i);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            currentTask = &task;
+            taskCount = count;
+            nextTask = 0;
+            activeWorkers = threads - 1;
+            busyWorkers = activeWorkers;
+            ++generation;
+        }
+        wake.notify_all();
+        runTasks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busyWorkers == 0; });
+        currentTask = nullptr;
+    }
+
+private:
+    void runTasks() {
+        for (size_t i = nextTask.fetch_add(1); i < taskCount; i = nextTask.fetch_add(1)) {
+            (*currentTask)(i);
+        }
+    }
+
+    void workerLoop(unsigned id) {
+        uint64_t seenGeneration = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping) {
+                    return;
+                }
+                seenGeneration = generation;
+                if (id >= activeWorkers) {
+                    continue;
+                }
+            }
+            runTasks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --busyWorkers;
+            }
+            done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* currentTask = nullptr;
+    size_t taskCount = 0;
+    std::atomic<size_t> nextTask{0};
+    unsigned activeWorkers = 0;
+    unsigned busyWorkers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+ThreadPool& threadPool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+// Divide [0, count) em blocos de ate grain elementos e chama body(begin, end) em paralelo.
+void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    size_t blocks = (count + grain - 1) / grain;
+    threadPool().run(blocks, [&](size_t block) {
+        size_t begin = block * grain;
+        body(begin, std::min(count, begin + grain));
+    });
+}
+
+// Niveis de log: 0 = nada, 1 = resumo por segundo, 2 = resumo por frame e
+// transformacoes, 3 = tudo.
+enum TraceLevel {
+    TRACE_OFF,
+    TRACE_INFO,
+    TRACE_DEBUG,
+    TRACE_ALL
+};
+
+enum TraceEventType : uint8_t {
+    TRACE_SCALE,
+    TRACE_TRANSLATION,
+    TRACE_ROTATION_X,
+    TRACE_ROTATION_Y,
+    TRACE_ROTATION_Z,
+    TRACE_SHEARING,
+    TRACE_REFLECTION,
+    TRACE_FRAME,
+    TRACE_UPLOAD,
+    TRACE_CULL
+};
+
+struct TraceEvent {
+    TraceEventType type;
+    int32_t step;
+    float values[3];
+};
+
+// Fila circular sem locks com um produtor (a thread de render) e um consumidor
+// (a thread de log). Quando enche, os eventos novos sao descartados e contados.
+class TraceRing {
+public:
+    static const size_t capacity = 1 << 14;
+
+    bool push(const TraceEvent& event) {
+        size_t head = writeIndex.load(std::memory_order_relaxed);
+        if (head - readIndex.load(std::memory_order_acquire) == capacity) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events[head & (capacity - 1)] = event;
+        writeIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(TraceEvent& event) {
+        size_t tail = readIndex.load(std::memory_order_relaxed);
+        if (tail == writeIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        event = events[tail & (capacity - 1)];
+        readIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t takeDropped() {
+        return dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    TraceEvent events[capacity];
+    alignas(64) std::atomic<size_t> writeIndex{0};
+    alignas(64) std::atomic<size_t> readIndex{0};
+    alignas(64) std::atomic<size_t> dropped{0};
+};
+
+int traceLevel = TRACE_INFO;
+TraceRing traceRing;
+std::thread traceThread;
+std::atomic<bool> traceRunning{false};
+
+inline void traceEvent(int level, TraceEventType type, int step, float a = 0.0f, float b = 0.0f, float c = 0.0f) {
+    if (level <= traceLevel && traceRunning.load(std::memory_order_relaxed)) {
+        traceRing.push({type, step, {a, b, c}});
+    }
+}
+
+void printTraceEvent(const TraceEvent& event) {
+    const float* v = event.values;
+    switch (event.type) {
+        case TRACE_SCALE:
+            std::cout << "Scaling: " << v[0] << ", " << v[1] << ", " << v[2] << '\n';
+            break;
+        case TRACE_TRANSLATION:
+            std::cout << "Translation: " << v[0] << ", " << v[1] << ", " << v[2] << '\n';
+            break;
+        case TRACE_ROTATION_X:
+            std::cout << "Rotation X: " << v[0] << '\n';
+            break;
+        case TRACE_ROTATION_Y:
+            std::cout << "Rotation Y: " << v[0] << '\n';
+            break;
+        case TRACE_ROTATION_Z:
+            std::cout << "Rotation Z: " << v[0] << '\n';
+            break;
+        case TRACE_SHEARING:
+            std::cout << "Shearing: " << v[0] << ", " << v[1] << ", " << v[2] << '\n';
+            break;
+        case TRACE_REFLECTION:
+            std::cout << "Reflection: " << v[0] << ", " << v[1] << ", " << v[2] << '\n';
+            break;
+        case TRACE_FRAME:
+            std::cout << "Frame: step " << event.step << ", " << v[0] << " ms\n";
+            break;
+        case TRACE_UPLOAD:
+            std::cout << "Upload: " << v[0] << " vertices, " << v[1] << " triangles\n";
+            break;
+        case TRACE_CULL:
+            std::cout << "Culling: " << v[0] << " of " << v[1] << " clusters, " << v[2] << " triangles submitted\n";
+            break;
+    }
+}
+
+// Esvazia a fila em segundo plano. Frames sao agregados num resumo por segundo
+// no nivel TRACE_INFO; nos niveis acima cada frame tambem e impresso.
+void traceThreadLoop() {
+    using clock = std::chrono::steady_clock;
+    auto lastSummary = clock::now();
+    size_t frames = 0;
+    double frameMs = 0.0;
+    double worstFrameMs = 0.0;
+    int step = -1;
+    size_t cullFrames = 0;
+    double visibleClusters = 0.0;
+    double submittedTriangles = 0.0;
+    bool running = true;
+    while (running) {
+        running = traceRunning.load(std::memory_order_acquire);
+        TraceEvent event;
+        bool printed = false;
+        while (traceRing.pop(event)) {
+            if (event.type == TRACE_FRAME) {
+                ++frames;
+                frameMs += event.values[0];
+                worstFrameMs = std::max(worstFrameMs, static_cast<double>(event.values[0]));
+                step = event.step;
+                if (traceLevel < TRACE_DEBUG) {
+                    continue;
+                }
+            }
+            if (event.type == TRACE_CULL) {
+                ++cullFrames;
+                visibleClusters += event.values[0];
+                submittedTriangles += event.values[2];
+                if (traceLevel < TRACE_ALL) {
+                    continue;
+                }
+            }
+            printTraceEvent(event);
+            printed = true;
+        }
+        auto now = clock::now();
+        if (frames > 0 && (now - lastSummary >= std::chrono::seconds(1) || !running)) {
+            std::cout << "Frames: " << frames << ", avg " << frameMs / frames << " ms, worst " << worstFrameMs
+                      << " ms, step " << step;
+            if (cullFrames > 0) {
+                std::cout << ", avg " << visibleClusters / cullFrames << " clusters and "
+                          << submittedTriangles / cullFrames << " triangles submitted";
+            }
+            std::cout << '\n';
+            frames = 0;
+            cullFrames = 0;
+            visibleClusters = 0.0;
+            submittedTriangles = 0.0;
+            frameMs = 0.0;
+            worstFrameMs = 0.0;
+            lastSummary = now;
+            printed = true;
+        }
+        if (size_t dropped = traceRing.takeDropped()) {
+            std::cout << "Trace: dropped " << dropped << " events\n";
+            printed = true;
+        }
+        if (printed) {
+            std::cout.flush();
+        }
+        if (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
 
-        if (type == "v") {
-            Vertex vertex;
-            iss >> vertex.x >> vertex.y >> vertex.z;
-            vertices.push_back(vertex);
-        } else if (type == "f") {
-            Face face;
-            std::string v1, v2, v3;
-            iss >> v1 >> v2 >> v3;
+void startTraceThread() {
+    if (traceLevel > TRACE_OFF && !traceRunning.exchange(true)) {
+        traceThread = std::thread(traceThreadLoop);
+    }
+}
+
+void stopTraceThread() {
+    if (traceRunning.exchange(false)) {
+        traceThread.join();
+    }
+}
 
+// 0 = usar todos os nucleos
+unsigned parseThreads = 0;
 
-            face.v1 = std::stoi(v1.substr(0, v1.find('/'))) - 1;
-            face.v2 = std::stoi(v2.substr(0, v2.find('/'))) - 1;
-            face.v3 = std::stoi(v3.substr(0, v3.find('/'))) - 1;
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+};
 
-            faces.push_back(face);
-        } else if (type == "s" || type == "t" || type == "x" || type == "y" || type == "z" || type == "c" || type == "e") {
-            transformations.push_back(line);
+bool mapFile(const char* path, MappedFile& file) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    file.size = static_cast<size_t>(st.st_size);
+    file.data = nullptr;
+    if (file.size > 0) {
+        void* addr = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return false;
         }
+        madvise(addr, file.size, MADV_SEQUENTIAL);
+        file.data = static_cast<const char*>(addr);
     }
+    close(fd); // o mapeamento continua valido depois do close
     return true;
 }
 
-void calculateFaceNormals() {
-    for (auto& face : faces) {
-        Vertex v1 = vertices[face.v1];
-        Vertex v2 = vertices[face.v2];
-        Vertex v3 = vertices[face.v3];
+void unmapFile(MappedFile& file) {
+    if (file.data) {
+        munmap(const_cast<char*>(file.data), file.size);
+    }
+    file.data = nullptr;
+    file.size = 0;
+}
 
-        float normal[3];
-        float u[3] = {v2.x - v1.x, v2.y - v1.y, v2.z - v1.z};
-        float v[3] = {v3.x - v1.x, v3.y - v1.y, v3.z - v1.z};
+inline const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        ++p;
+    }
+    return p;
+}
 
-        normal[0] = u[1] * v[2] - u[2] * v[1];
-        normal[1] = u[2] * v[0] - u[0] * v[2];
-        normal[2] = u[0] * v[1] - u[1] * v[0];
+inline const char* skipToken(const char* p, const char* end) {
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        ++p;
+    }
+    return p;
+}
 
-        float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+// Le um float no lugar; se nao houver numero, out fica inalterado.
+inline const char* parseFloat(const char* p, const char* end, float& out) {
+    p = skipSpaces(p, end);
+    if (p < end && *p == '+') {
+        ++p;
+    }
+    auto result = std::from_chars(p, end, out);
+    return result.ec == std::errc() ? result.ptr : skipToken(p, end);
+}
+
+inline bool parseInt(const char*& p, const char* end, int& out) {
+    if (p < end && *p == '+') {
+        ++p;
+    }
+    auto result = std::from_chars(p, end, out);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
 
-        face.normal[0] = normal[0] / length;
-        face.normal[1] = normal[1] / length;
-        face.normal[2] = normal[2] / length;
+// Le um canto "v", "v/vt", "v//vn" ou "v/vt/vn"; vt e vn ficam 0 quando ausentes.
+// Devolve false se o token nao comecar com um inteiro.
+inline bool parseCorner(const char*& p, const char* end, int& v, int& vt, int& vn) {
+    p = skipSpaces(p, end);
+    const char* tokenEnd = skipToken(p, end);
+    vt = 0;
+    vn = 0;
+    bool valid = parseInt(p, tokenEnd, v);
+    if (valid && p < tokenEnd && *p == '/') {
+        ++p;
+        parseInt(p, tokenEnd, vt);
+        if (p < tokenEnd && *p == '/') {
+            ++p;
+            parseInt(p, tokenEnd, vn);
+        }
     }
+    p = tokenEnd;
+    return valid;
 }
-void calculateVertexNormals() {
-    vertexNormals.resize(vertices.size());
-    for (auto& normal : vertexNormals) {
-        normal = {0.0f, 0.0f, 0.0f};
+
+// OBJ usa indices a partir de 1; negativos sao relativos ao ultimo elemento lido.
+inline int resolveIndex(int index, int count) {
+    return index < 0 ? count + index : index - 1;
+}
+
+bool isTransformationType(char c) {
+    return c == 's' || c == 't' || c == 'x' || c == 'y' || c == 'z' || c == 'c' || c == 'e';
+}
+
+// Indices de vt ou vn por canto, paralelos a faceIndices. Ficam vazios ate o
+// primeiro canto que usa o atributo; os cantos sem ele recebem -1.
+struct CornerAttribute {
+    std::vector<int> indices;
+    std::vector<size_t> relativeCorners;
+
+    void append(size_t corner, int objIndex, int count) {
+        if (objIndex == 0 && indices.empty()) {
+            return;
+        }
+        if (indices.empty()) {
+            indices.assign(corner, -1);
+        }
+        if (objIndex < 0) {
+            relativeCorners.push_back(corner);
+        }
+        indices.push_back(objIndex == 0 ? -1 : resolveIndex(objIndex, count));
+    }
+
+    void truncate(size_t corner) {
+        if (indices.size() > corner) {
+            indices.resize(corner);
+        }
+        while (!relativeCorners.empty() && relativeCorners.back() >= corner) {
+            relativeCorners.pop_back();
+        }
+    }
+};
+
+// Resultado do parse de um trecho do arquivo. faceEnds guarda o fim de cada
+// face em faceIndices. Indices relativos (negativos) sao guardados relativos ao
+// inicio do trecho e suas posicoes ficam em relativeCorners para serem
+// corrigidas no merge.
+struct OBJChunk {
+    std::vector<Vertex> vertices;
+    std::vector<float> texcoords;
+    std::vector<float> normals;
+    std::vector<uint32_t> faceEnds;
+    std::vector<int> faceIndices;
+    std::vector<size_t> relativeCorners;
+    CornerAttribute faceTexcoords;
+    CornerAttribute faceNormals;
+    std::vector<std::string> transformations;
+};
+
+void parseOBJLine(const char* line, const char* end, OBJChunk& chunk) {
+    const char* p = skipSpaces(line, end);
+    const char* typeEnd = skipToken(p, end);
+    size_t typeLength = typeEnd - p;
+    if (typeLength == 0 || typeLength > 2) {
+        return;
+    }
+    char type = *p;
+    char subtype = typeLength == 2 ? p[1] : '\0';
+    p = typeEnd;
+
+    if (type == 'v' && subtype == '\0') {
+        Vertex vertex = {0.0f, 0.0f, 0.0f};
+        p = parseFloat(p, end, vertex.x);
+        p = parseFloat(p, end, vertex.y);
+        parseFloat(p, end, vertex.z);
+        chunk.vertices.push_back(vertex);
+    } else if (type == 'v' && subtype == 't') {
+        float uv[2] = {0.0f, 0.0f};
+        p = parseFloat(p, end, uv[0]);
+        parseFloat(p, end, uv[1]);
+        chunk.texcoords.insert(chunk.texcoords.end(), uv, uv + 2);
+    } else if (type == 'v' && subtype == 'n') {
+        float normal[3] = {0.0f, 0.0f, 0.0f};
+        p = parseFloat(p, end, normal[0]);
+        p = parseFloat(p, end, normal[1]);
+        parseFloat(p, end, normal[2]);
+        chunk.normals.insert(chunk.normals.end(), normal, normal + 3);
+    } else if (type == 'f' && subtype == '\0') {
+        int vertexCount = static_cast<int>(chunk.vertices.size());
+        int texcoordCount = static_cast<int>(chunk.texcoords.size() / 2);
+        int normalCount = static_cast<int>(chunk.normals.size() / 3);
+        size_t first = chunk.faceIndices.size();
+        size_t firstRelative = chunk.relativeCorners.size();
+        int v, vt, vn;
+        while (skipSpaces(p, end) < end && parseCorner(p, end, v, vt, vn)) {
+            size_t corner = chunk.faceIndices.size();
+            if (v < 0) {
+                chunk.relativeCorners.push_back(corner);
+            }
+            chunk.faceIndices.push_back(resolveIndex(v, vertexCount));
+            chunk.faceTexcoords.append(corner, vt, texcoordCount);
+            chunk.faceNormals.append(corner, vn, normalCount);
+        }
+        if (chunk.faceIndices.size() - first < 3) {
+            chunk.faceIndices.resize(first);
+            chunk.relativeCorners.resize(firstRelative);
+            chunk.faceTexcoords.truncate(first);
+            chunk.faceNormals.truncate(first);
+            return;
+        }
+        chunk.faceEnds.push_back(static_cast<uint32_t>(chunk.faceIndices.size()));
+    } else if (subtype == '\0' && isTransformationType(type)) {
+        while (end > line && end[-1] == '\r') {
+            --end;
+        }
+        chunk.transformations.emplace_back(line, end);
+    }
+}
+
+void parseOBJRange(const char* p, const char* end, OBJChunk& chunk) {
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        parseOBJLine(p, lineEnd, chunk);
+        p = lineEnd + 1;
+    }
+}
+
+// Desloca os indices relativos de vt ou vn de um trecho pela base do trecho.
+void resolveCornerAttribute(CornerAttribute& chunkAttribute, int offset, size_t cornerCount) {
+    if (chunkAttribute.indices.empty()) {
+        return;
+    }
+    chunkAttribute.indices.resize(cornerCount, -1);
+    for (size_t corner : chunkAttribute.relativeCorners) {
+        chunkAttribute.indices[corner] += offset;
+    }
+    chunkAttribute.relativeCorners.clear();
+}
+
+// Completa os indices relativos de um trecho com as bases dele e descarta as
+// faces com algum vertice fora de [0, vertexCount), como o parse ja faz com as
+// de menos de 3 cantos. So aqui os indices relativos sao finais. Devolve o
+// numero de faces descartadas.
+size_t resolveChunkFaces(OBJChunk& chunk, int vertexOffset, int texcoordOffset, int normalOffset,
+                         size_t vertexCount) {
+    for (size_t corner : chunk.relativeCorners) {
+        chunk.faceIndices[corner] += vertexOffset;
+    }
+    chunk.relativeCorners.clear();
+    size_t cornerCount = chunk.faceIndices.size();
+    resolveCornerAttribute(chunk.faceTexcoords, texcoordOffset, cornerCount);
+    resolveCornerAttribute(chunk.faceNormals, normalOffset, cornerCount);
+
+    std::vector<int>& texcoords = chunk.faceTexcoords.indices;
+    std::vector<int>& normals = chunk.faceNormals.indices;
+    size_t write = 0;
+    size_t faceStart = 0;
+    size_t kept = 0;
+    for (size_t f = 0; f < chunk.faceEnds.size(); ++f) {
+        size_t faceEnd = chunk.faceEnds[f];
+        bool valid = true;
+        for (size_t corner = faceStart; corner < faceEnd; ++corner) {
+            int v = chunk.faceIndices[corner];
+            valid = valid && v >= 0 && static_cast<size_t>(v) < vertexCount;
+        }
+        if (valid) {
+            for (size_t corner = faceStart; corner < faceEnd; ++corner, ++write) {
+                chunk.faceIndices[write] = chunk.faceIndices[corner];
+                if (!texcoords.empty()) {
+                    texcoords[write] = texcoords[corner];
+                }
+                if (!normals.empty()) {
+                    normals[write] = normals[corner];
+                }
+            }
+            chunk.faceEnds[kept++] = static_cast<uint32_t>(write);
+        }
+        faceStart = faceEnd;
+    }
+    size_t dropped = chunk.faceEnds.size() - kept;
+    chunk.faceEnds.resize(kept);
+    chunk.faceIndices.resize(write);
+    if (!texcoords.empty()) {
+        texcoords.resize(write);
+    }
+    if (!normals.empty()) {
+        normals.resize(write);
+    }
+    return dropped;
+}
+
+// Copia os indices de vt ou vn de um trecho para o array global, completando com
+// -1 os cantos de trechos que nao usam o atributo.
+void mergeCornerAttribute(const CornerAttribute& chunkAttribute, size_t indexBase, size_t cornerCount,
+                          std::vector<int>& indices) {
+    if (chunkAttribute.indices.empty()) {
+        std::fill_n(indices.begin() + indexBase, cornerCount, -1);
+        return;
+    }
+    std::copy(chunkAttribute.indices.begin(), chunkAttribute.indices.end(), indices.begin() + indexBase);
+}
+
+// Trechos menores que isso nao compensam o custo de distribuir entre threads.
+const size_t minParseChunkSize = 1 << 20;
+
+// Faz o parse do arquivo mapeado em trechos alinhados a quebras de linha e junta
+// os resultados nos arrays globais com soma de prefixos. Devolve o numero de
+// faces descartadas por indices de vertice invalidos.
+size_t parseOBJ(const MappedFile& file, unsigned threads) {
+    if (threads == 0) {
+        threads = threadPool().size();
+    }
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threads * 4, file.size / minParseChunkSize));
+    if (threads == 1) {
+        chunkCount = 1;
+    }
+
+    const char* end = file.data + file.size;
+    std::vector<const char*> bounds(chunkCount + 1);
+    bounds[0] = file.data;
+    bounds[chunkCount] = end;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        const char* p = std::max(bounds[i - 1], file.data + file.size / chunkCount * i);
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        bounds[i] = newline ? newline + 1 : end;
+    }
+
+    std::vector<OBJChunk> chunks(chunkCount);
+    threadPool().run(chunkCount, [&](size_t i) {
+        parseOBJRange(bounds[i], bounds[i + 1], chunks[i]);
+    }, threads);
+
+    if (faceOffsets.empty()) {
+        faceOffsets.push_back(0);
+    }
+    std::vector<size_t> vertexBase(chunkCount + 1, vertices.size());
+    std::vector<size_t> texcoordBase(chunkCount + 1, objTexcoords.size());
+    std::vector<size_t> normalBase(chunkCount + 1, objNormals.size());
+    for (size_t i = 0; i < chunkCount; ++i) {
+        vertexBase[i + 1] = vertexBase[i] + chunks[i].vertices.size();
+        texcoordBase[i + 1] = texcoordBase[i] + chunks[i].texcoords.size();
+        normalBase[i + 1] = normalBase[i] + chunks[i].normals.size();
+    }
+    std::vector<size_t> droppedFaces(chunkCount);
+    threadPool().run(chunkCount, [&](size_t i) {
+        droppedFaces[i] = resolveChunkFaces(chunks[i], static_cast<int>(vertexBase[i]),
+                                            static_cast<int>(texcoordBase[i] / 2), static_cast<int>(normalBase[i] / 3),
+                                            vertexBase[chunkCount]);
+    }, threads);
+
+    std::vector<size_t> faceBase(chunkCount + 1, faceOffsets.size() - 1);
+    std::vector<size_t> indexBase(chunkCount + 1, faceIndices.size());
+    bool hasTexcoords = !faceTexcoordIndices.empty();
+    bool hasNormals = !faceNormalIndices.empty();
+    for (size_t i = 0; i < chunkCount; ++i) {
+        faceBase[i + 1] = faceBase[i] + chunks[i].faceEnds.size();
+        indexBase[i + 1] = indexBase[i] + chunks[i].faceIndices.size();
+        hasTexcoords = hasTexcoords || !chunks[i].faceTexcoords.indices.empty();
+        hasNormals = hasNormals || !chunks[i].faceNormals.indices.empty();
+    }
+    // Malhas anteriores sem vt/vn recebem -1 nos seus cantos.
+    if (hasTexcoords) {
+        faceTexcoordIndices.resize(faceIndices.size(), -1);
+        faceTexcoordIndices.resize(indexBase[chunkCount]);
+    }
+    if (hasNormals) {
+        faceNormalIndices.resize(faceIndices.size(), -1);
+        faceNormalIndices.resize(indexBase[chunkCount]);
+    }
+    vertices.resize(vertexBase[chunkCount]);
+    objTexcoords.resize(texcoordBase[chunkCount]);
+    objNormals.resize(normalBase[chunkCount]);
+    faceOffsets.resize(faceBase[chunkCount] + 1);
+    faceIndices.resize(indexBase[chunkCount]);
+
+    threadPool().run(chunkCount, [&](size_t i) {
+        const OBJChunk& chunk = chunks[i];
+        size_t cornerCount = chunk.faceIndices.size();
+        if (hasTexcoords) {
+            mergeCornerAttribute(chunk.faceTexcoords, indexBase[i], cornerCount, faceTexcoordIndices);
+        }
+        if (hasNormals) {
+            mergeCornerAttribute(chunk.faceNormals, indexBase[i], cornerCount, faceNormalIndices);
+        }
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + vertexBase[i]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), objTexcoords.begin() + texcoordBase[i]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), objNormals.begin() + normalBase[i]);
+        std::copy(chunk.faceIndices.begin(), chunk.faceIndices.end(), faceIndices.begin() + indexBase[i]);
+        uint32_t* offsets = &faceOffsets[faceBase[i] + 1];
+        for (size_t f = 0; f < chunk.faceEnds.size(); ++f) {
+            offsets[f] = static_cast<uint32_t>(indexBase[i] + chunk.faceEnds[f]);
+        }
+    }, threads);
+
+    for (auto& chunk : chunks) {
+        for (auto& transformation : chunk.transformations) {
+            transformations.push_back(std::move(transformation));
+        }
+    }
+    size_t dropped = 0;
+    for (size_t count : droppedFaces) {
+        dropped += count;
+    }
+    return dropped;
+}
+
+// Solda de vertices: posicoes a ate weldEpsilon de distancia viram um so vertice.
+// Desligada por padrao; ligada com --weld EPS.
+bool weldEnabled = false;
+float weldEpsilon = 1e-6f;
+
+inline uint64_t weldCellHash(int64_t x, int64_t y, int64_t z) {
+    uint64_t h = static_cast<uint64_t>(x) * 0x9E3779B185EBCA87ull;
+    h ^= static_cast<uint64_t>(y) * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+    h ^= static_cast<uint64_t>(z) * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+}
+
+// Celula da grade da solda numa coordenada; valores nao finitos vao para a 0.
+inline int64_t weldCell(float value, float cellSize) {
+    float cell = std::floor(value / cellSize);
+    return std::isfinite(cell) ? static_cast<int64_t>(cell) : 0;
+}
+
+// Junta vertices coincidentes usando uma grade hash com celulas de lado epsilon.
+// Cada vertice procura, nas 27 celulas vizinhas, o vertice de menor indice a ate
+// epsilon de distancia; as cadeias resultantes sao resolvidas numa passada linear,
+// o que deixa o resultado deterministico mesmo com a busca em paralelo. Deve rodar
+// antes de deindexAttributes(), pois so remapeia faceIndices.
+void weldVertices(float epsilon) {
+    size_t vertexCount = vertices.size();
+    if (vertexCount == 0 || !(epsilon >= 0.0f)) {
+        return;
+    }
+    // A celula nunca e menor que a maior coordenada / 2^40: abaixo disso o
+    // float ja nao separa as posicoes, e o quociente fica longe do limite do
+    // int64 mesmo com --weld 0 em coordenadas georreferenciadas.
+    float largest = 0.0f;
+    for (const Vertex& v : vertices) {
+        for (float value : {v.x, v.y, v.z}) {
+            if (std::isfinite(value)) {
+                largest = std::max(largest, std::fabs(value));
+            }
+        }
+    }
+    float cellSize = std::max({epsilon, largest * 0x1p-40f, 1e-12f});
+    float epsilonSquared = epsilon * epsilon;
+    size_t bucketCount = 1;
+    while (bucketCount < vertexCount * 2) {
+        bucketCount <<= 1;
+    }
+    size_t bucketMask = bucketCount - 1;
+    const size_t grain = 1 << 16;
+
+    std::vector<int64_t> cells(vertexCount * 3);
+    std::vector<uint32_t> vertexBucket(vertexCount);
+    std::unique_ptr<std::atomic<uint32_t>[]> bucketFill(new std::atomic<uint32_t>[bucketCount]);
+    parallelFor(bucketCount, grain, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; ++b) {
+            bucketFill[b].store(0, std::memory_order_relaxed);
+        }
+    });
+    parallelFor(vertexCount, grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int64_t* cell = &cells[i * 3];
+            cell[0] = weldCell(vertices[i].x, cellSize);
+            cell[1] = weldCell(vertices[i].y, cellSize);
+            cell[2] = weldCell(vertices[i].z, cellSize);
+            vertexBucket[i] = static_cast<uint32_t>(weldCellHash(cell[0], cell[1], cell[2]) & bucketMask);
+            bucketFill[vertexBucket[i]].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    // Buckets em CSR; cada bucket e ordenado por indice depois de preenchido.
+    std::vector<uint32_t> bucketStart(bucketCount + 1, 0);
+    for (size_t b = 0; b < bucketCount; ++b) {
+        bucketStart[b + 1] = bucketStart[b] + bucketFill[b].load(std::memory_order_relaxed);
+        bucketFill[b].store(bucketStart[b], std::memory_order_relaxed);
+    }
+    std::vector<uint32_t> bucketVertices(vertexCount);
+    parallelFor(vertexCount, grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            bucketVertices[bucketFill[vertexBucket[i]].fetch_add(1, std::memory_order_relaxed)] =
+                    static_cast<uint32_t>(i);
+        }
+    });
+    parallelFor(bucketCount, grain, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; ++b) {
+            std::sort(bucketVertices.begin() + bucketStart[b], bucketVertices.begin() + bucketStart[b + 1]);
+        }
+    });
+
+    std::vector<uint32_t> weldTarget(vertexCount);
+    parallelFor(vertexCount, grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const Vertex& p = vertices[i];
+            const int64_t* cell = &cells[i * 3];
+            uint32_t target = static_cast<uint32_t>(i);
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dz = -1; dz <= 1; ++dz) {
+                        size_t b = weldCellHash(cell[0] + dx, cell[1] + dy, cell[2] + dz) & bucketMask;
+                        for (uint32_t k = bucketStart[b]; k < bucketStart[b + 1]; ++k) {
+                            uint32_t other = bucketVertices[k];
+                            if (other >= target) {
+                                break;
+                            }
+                            const Vertex& q = vertices[other];
+                            float x = p.x - q.x, y = p.y - q.y, z = p.z - q.z;
+                            if (x * x + y * y + z * z <= epsilonSquared) {
+                                target = other;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+            weldTarget[i] = target;
+        }
+    });
+
+    // weldTarget[i] <= i, entao uma passada em ordem resolve as cadeias e numera
+    // os vertices que sobram.
+    std::vector<int> remap(vertexCount);
+    size_t kept = 0;
+    for (size_t i = 0; i < vertexCount; ++i) {
+        if (weldTarget[i] == i) {
+            vertices[kept] = vertices[i];
+            remap[i] = static_cast<int>(kept++);
+        } else {
+            remap[i] = remap[weldTarget[i]];
+        }
+    }
+    vertices.resize(kept);
+    vertices.shrink_to_fit();
+    parallelFor(faceIndices.size(), grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            faceIndices[i] = remap[faceIndices[i]];
+        }
+    });
+
+    size_t removed = vertexCount - kept;
+    // Posicao mais a normal por vertice que deixa de existir.
+    size_t savedBytes = removed * (sizeof(Vertex) + 3 * sizeof(float));
+    std::cout << "Welded vertices (epsilon " << epsilon << "): removed " << removed << " of " << vertexCount
+              << ", saved " << savedBytes / 1024.0 << " KB" << std::endl;
+}
+
+// Junta posicao, vt e vn de cada canto num unico vertice, para que um so indice
+// por canto enderece todos os atributos, como a GPU espera. Cantos com a mesma
+// combinacao reaproveitam o vertice. Depois disso faceIndices aponta para os
+// novos vertices, vertexTexcoords tem 2 floats por vertice e, se todos os cantos
+// tinham vn, vertexNormals ja vem preenchido com as normais do arquivo.
+// loadOBJ ja descarta faces com vertices invalidos; um indice fora da faixa
+// aqui e erro de quem montou os arrays, e nada e alterado.
+bool deindexAttributes() {
+    for (int v : faceIndices) {
+        if (v < 0 || static_cast<size_t>(v) >= vertices.size()) {
+            std::cerr << "Face index " << v << " out of range for " << vertices.size() << " vertices" << std::endl;
+            return false;
+        }
+    }
+    bool hasTexcoords = !faceTexcoordIndices.empty();
+    bool hasNormals = !faceNormalIndices.empty();
+    authoredNormals = false;
+    vertexTexcoords.clear();
+    if (!hasTexcoords && !hasNormals) {
+        objTexcoords.clear();
+        objNormals.clear();
+        return true;
+    }
+
+    // Lista encadeada de variantes (vt, vn) por posicao.
+    std::vector<int> firstVariant(vertices.size(), -1);
+    std::vector<int> nextVariant;
+    std::vector<int> variantPosition;
+    std::vector<int> variantTexcoord;
+    std::vector<int> variantNormal;
+    int texcoordCount = static_cast<int>(objTexcoords.size() / 2);
+    int normalCount = static_cast<int>(objNormals.size() / 3);
+    bool allNormals = hasNormals;
+    for (size_t corner = 0; corner < faceIndices.size(); ++corner) {
+        int v = faceIndices[corner];
+        int vt = hasTexcoords ? faceTexcoordIndices[corner] : -1;
+        int vn = hasNormals ? faceNormalIndices[corner] : -1;
+        if (vt < 0 || vt >= texcoordCount) {
+            vt = -1;
+        }
+        if (vn < 0 || vn >= normalCount) {
+            vn = -1;
+            allNormals = false;
+        }
+        int variant = firstVariant[v];
+        while (variant >= 0 && (variantTexcoord[variant] != vt || variantNormal[variant] != vn)) {
+            variant = nextVariant[variant];
+        }
+        if (variant < 0) {
+            variant = static_cast<int>(variantPosition.size());
+            variantPosition.push_back(v);
+            variantTexcoord.push_back(vt);
+            variantNormal.push_back(vn);
+            nextVariant.push_back(firstVariant[v]);
+            firstVariant[v] = variant;
+        }
+        faceIndices[corner] = variant;
+    }
+
+    size_t unifiedCount = variantPosition.size();
+    std::vector<Vertex> unifiedVertices(unifiedCount);
+    for (size_t i = 0; i < unifiedCount; ++i) {
+        unifiedVertices[i] = vertices[variantPosition[i]];
+    }
+    vertices.swap(unifiedVertices);
+    if (hasTexcoords) {
+        vertexTexcoords.assign(unifiedCount * 2, 0.0f);
+        for (size_t i = 0; i < unifiedCount; ++i) {
+            if (variantTexcoord[i] >= 0) {
+                vertexTexcoords[i * 2] = objTexcoords[variantTexcoord[i] * 2];
+                vertexTexcoords[i * 2 + 1] = objTexcoords[variantTexcoord[i] * 2 + 1];
+            }
+        }
     }
+    if (allNormals) {
+        vertexNormals.resize(unifiedCount * 3);
+        for (size_t i = 0; i < unifiedCount; ++i) {
+            std::memcpy(&vertexNormals[i * 3], &objNormals[variantNormal[i] * 3], 3 * sizeof(float));
+        }
+        authoredNormals = true;
+    }
+
+    faceTexcoordIndices.clear();
+    faceNormalIndices.clear();
+    objTexcoords.clear();
+    objNormals.clear();
+    return true;
+}
+
+// Esvazia tudo que parseOBJ preenche. parseOBJ acrescenta ao que ja existe e
+// resolve indices relativos pelas contagens atuais, entao cada arquivo tem que
+// comecar daqui.
+void clearParsedOBJ() {
+    vertices.clear();
+    faceOffsets.clear();
+    faceIndices.clear();
+    objTexcoords.clear();
+    objNormals.clear();
+    faceTexcoordIndices.clear();
+    faceNormalIndices.clear();
+    transformations.clear();
+}
+
+bool loadOBJ(const char* path) {
+    MappedFile file;
+    if (!mapFile(path, file)) {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+    clearParsedOBJ();
+
+    auto start = std::chrono::steady_clock::now();
+    size_t dropped = parseOBJ(file, parseThreads);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (dropped > 0) {
+        std::cerr << "Skipped " << dropped << " faces with vertex indices out of range in " << path << std::endl;
+    }
+
+    double megabytes = file.size / (1024.0 * 1024.0);
+    std::cout << "Loaded " << path << ": " << vertices.size() << " vertices, " << faceOffsets.size() - 1
+              << " faces, " << megabytes << " MB in " << elapsed.count() * 1000.0 << " ms ("
+              << (elapsed.count() > 0 ? megabytes / elapsed.count() : 0.0) << " MB/s)" << std::endl;
+
+    unmapFile(file);
+    return true;
+}
+
+// Mede o parse com 1, 2, 4, ... threads sobre o mesmo arquivo ja mapeado.
+bool benchmarkParse(const char* path) {
+    MappedFile file;
+    if (!mapFile(path, file)) {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+    volatile char sink = 0;
+    for (size_t i = 0; i < file.size; i += 4096) {
+        sink = sink + file.data[i]; // carrega as paginas antes de medir
+    }
+
+    double megabytes = file.size / (1024.0 * 1024.0);
+    double baseline = 0.0;
+    unsigned maxThreads = threadPool().size();
+    for (unsigned threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+        double best = 1e30;
+        for (int run = 0; run < 5; ++run) {
+            clearParsedOBJ();
+            auto start = std::chrono::steady_clock::now();
+            parseOBJ(file, threads);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        if (threads == 1) {
+            baseline = best;
+        }
+        std::cout << "threads " << threads << ": " << best * 1000.0 << " ms, " << megabytes / best << " MB/s, speedup "
+                  << baseline / best << "x" << std::endl;
+        if (threads == maxThreads) {
+            break;
+        }
+    }
+    unmapFile(file);
+    return true;
+}
+
+// Triangula todas as faces em leque (v0, vk, vk+1). Uma face com n vertices gera
+// n - 2 triangulos, entao a face f comeca no triangulo faceOffsets[f] - 2 * f e
+// cada face pode ser escrita de forma independente.
+void triangulateFaces() {
+    size_t faceCount = faceOffsets.empty() ? 0 : faceOffsets.size() - 1;
+    triangles.resize(faceIndices.size() - 2 * faceCount);
+    parallelFor(faceCount, 1 << 16, [](size_t begin, size_t end) {
+        const int* indices = faceIndices.data();
+        for (size_t f = begin; f < end; ++f) {
+            uint32_t first = faceOffsets[f];
+            uint32_t last = faceOffsets[f + 1];
+            Triangle* out = &triangles[first - 2 * f];
+            for (uint32_t k = first + 1; k + 1 < last; ++k) {
+                *out++ = {indices[first], indices[k], indices[k + 1]};
+            }
+        }
+    });
+}
+
+// Tamanho do cache de vertices pos-transformacao simulado (FIFO).
+const size_t vertexCacheSize = 16;
+// ACMR (vertices transformados por triangulo) da ordem lida do arquivo.
+double loadedACMR = 0.0;
+
+// Simula o cache FIFO sobre os triangulos na ordem dada e devolve o ACMR.
+double simulateACMR(const std::vector<uint32_t>& order) {
+    if (order.empty()) {
+        return 0.0;
+    }
+    std::vector<uint32_t> insertedAt(vertices.size(), 0);
+    uint32_t time = static_cast<uint32_t>(vertexCacheSize) + 1;
+    size_t misses = 0;
+    for (uint32_t t : order) {
+        const Triangle& face = triangles[t];
+        for (int v : {face.v1, face.v2, face.v3}) {
+            if (time - insertedAt[v] > vertexCacheSize) {
+                insertedAt[v] = time++;
+                ++misses;
+            }
+        }
+    }
+    return static_cast<double>(misses) / order.size();
+}
+
+// Tipsify (Sander, Nehab e Barczak, 2007): emite o leque de um vertice e
+// escolhe o proximo entre os vizinhos recem emitidos, preferindo os que
+// ainda estarao no cache quando todos os seus triangulos forem emitidos.
+// Quando nao ha candidato, volta pela pilha de vertices recentes e, por fim,
+// pelo proximo vertice com triangulos pendentes.
+std::vector<uint32_t> tipsifyOrder() {
+    size_t vertexCount = vertices.size();
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (const auto& face : triangles) {
+        ++offsets[face.v1 + 1];
+        ++offsets[face.v2 + 1];
+        ++offsets[face.v3 + 1];
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        offsets[v + 1] += offsets[v];
+    }
+    std::vector<uint32_t> adjacency(offsets[vertexCount]);
+    std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (uint32_t t = 0; t < triangles.size(); ++t) {
+        const Triangle& face = triangles[t];
+        adjacency[cursor[face.v1]++] = t;
+        adjacency[cursor[face.v2]++] = t;
+        adjacency[cursor[face.v3]++] = t;
+    }
+
+    std::vector<uint32_t> liveTriangles(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        liveTriangles[v] = offsets[v + 1] - offsets[v];
+    }
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<uint8_t> emitted(triangles.size(), 0);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> order;
+    order.reserve(triangles.size());
+    uint32_t time = static_cast<uint32_t>(vertexCacheSize) + 1;
+    size_t scan = 0;
+    int64_t fan = vertexCount > 0 ? 0 : -1;
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t k = offsets[fan]; k < offsets[fan + 1]; ++k) {
+            uint32_t t = adjacency[k];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = 1;
+            order.push_back(t);
+            const Triangle& face = triangles[t];
+            for (int v : {face.v1, face.v2, face.v3}) {
+                deadEnd.push_back(static_cast<uint32_t>(v));
+                candidates.push_back(static_cast<uint32_t>(v));
+                --liveTriangles[v];
+                if (time - cacheTime[v] > vertexCacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        fan = -1;
+        int64_t bestPriority = -1;
+        for (uint32_t v : candidates) {
+            if (liveTriangles[v] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * liveTriangles[v] <= vertexCacheSize) {
+                priority = time - cacheTime[v];
+            }
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                fan = v;
+            }
+        }
+        while (fan < 0 && !deadEnd.empty()) {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if (liveTriangles[v] > 0) {
+                fan = v;
+            }
+        }
+        while (fan < 0 && scan < vertexCount) {
+            if (liveTriangles[scan] > 0) {
+                fan = static_cast<int64_t>(scan);
+            }
+            ++scan;
+        }
+    }
+    return order;
+}
+
+// Reordena os triangulos com tipsifyOrder() e renumera os vertices na ordem
+// do primeiro uso, para que a GPU e os lacos de normais leiam vertices quase
+// em sequencia. Vertices sem triangulo vao para o fim. Deve rodar antes da
+// adjacencia, das arestas e da BVH, que guardam indices de vertices.
+void optimizeMeshOrder() {
+    std::vector<uint32_t> identity(triangles.size());
+    for (uint32_t t = 0; t < identity.size(); ++t) {
+        identity[t] = t;
+    }
+    loadedACMR = simulateACMR(identity);
+
+    std::vector<uint32_t> order = tipsifyOrder();
+    std::vector<Triangle> reordered(triangles.size());
+    for (size_t k = 0; k < order.size(); ++k) {
+        reordered[k] = triangles[order[k]];
+    }
+    triangles.swap(reordered);
+
+    size_t vertexCount = vertices.size();
+    std::vector<int> remap(vertexCount, -1);
+    int next = 0;
+    for (Triangle& face : triangles) {
+        for (int* corner : {&face.v1, &face.v2, &face.v3}) {
+            if (remap[*corner] < 0) {
+                remap[*corner] = next++;
+            }
+            *corner = remap[*corner];
+        }
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        if (remap[v] < 0) {
+            remap[v] = next++;
+        }
+    }
+    std::vector<Vertex> renumbered(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        renumbered[remap[v]] = vertices[v];
+    }
+    vertices.swap(renumbered);
+    auto renumberAttribute = [&](auto& values, size_t width) {
+        if (values.size() != vertexCount * width) {
+            return;
+        }
+        auto source = values;
+        for (size_t v = 0; v < vertexCount; ++v) {
+            std::copy(source.begin() + v * width, source.begin() + (v + 1) * width, values.begin() + remap[v] * width);
+        }
+    };
+    renumberAttribute(vertexTexcoords, 2);
+    renumberAttribute(vertexNormals, 3);
+    for (int& index : faceIndices) {
+        index = remap[index];
+    }
+}
+
+// Normais dos triangulos [begin, end), uma por vez.
+void faceNormalsScalar(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        const Triangle& face = triangles[i];
+        Vertex v1 = vertices[face.v1];
+        Vertex v2 = vertices[face.v2];
+        Vertex v3 = vertices[face.v3];
+
+        float normal[3];
+        float u[3] = {v2.x - v1.x, v2.y - v1.y, v2.z - v1.z};
+        float v[3] = {v3.x - v1.x, v3.y - v1.y, v3.z - v1.z};
+
+        normal[0] = u[1] * v[2] - u[2] * v[1];
+        normal[1] = u[2] * v[0] - u[0] * v[2];
+        normal[2] = u[0] * v[1] - u[1] * v[0];
+
+        float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+        triangleNormals[i * 3] = normal[0] / length;
+        triangleNormals[i * 3 + 1] = normal[1] / length;
+        triangleNormals[i * 3 + 2] = normal[2] / length;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 8 triangulos por iteracao: os indices e as posicoes sao lidos com gathers,
+// o produto vetorial e feito em SoA e 1/|n| vem de rsqrt com um passo de Newton.
+__attribute__((target("avx2,fma"))) void faceNormalsAVX2(size_t begin, size_t end) {
+    const int* indices = &triangles[0].v1;
+    const float* positions = &vertices[0].x;
+    float* out = triangleNormals.data();
+    const __m256i corner = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    alignas(32) float normal[3][8];
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        const int* base = indices + i * 3;
+        __m256i a = _mm256_mullo_epi32(_mm256_i32gather_epi32(base, corner, 4), three);
+        __m256i b = _mm256_mullo_epi32(_mm256_i32gather_epi32(base + 1, corner, 4), three);
+        __m256i c = _mm256_mullo_epi32(_mm256_i32gather_epi32(base + 2, corner, 4), three);
+
+        __m256 ax = _mm256_i32gather_ps(positions, a, 4);
+        __m256 ay = _mm256_i32gather_ps(positions + 1, a, 4);
+        __m256 az = _mm256_i32gather_ps(positions + 2, a, 4);
+        __m256 ux = _mm256_sub_ps(_mm256_i32gather_ps(positions, b, 4), ax);
+        __m256 uy = _mm256_sub_ps(_mm256_i32gather_ps(positions + 1, b, 4), ay);
+        __m256 uz = _mm256_sub_ps(_mm256_i32gather_ps(positions + 2, b, 4), az);
+        __m256 vx = _mm256_sub_ps(_mm256_i32gather_ps(positions, c, 4), ax);
+        __m256 vy = _mm256_sub_ps(_mm256_i32gather_ps(positions + 1, c, 4), ay);
+        __m256 vz = _mm256_sub_ps(_mm256_i32gather_ps(positions + 2, c, 4), az);
+
+        __m256 nx = _mm256_fmsub_ps(uy, vz, _mm256_mul_ps(uz, vy));
+        __m256 ny = _mm256_fmsub_ps(uz, vx, _mm256_mul_ps(ux, vz));
+        __m256 nz = _mm256_fmsub_ps(ux, vy, _mm256_mul_ps(uy, vx));
+
+        __m256 lengthSquared = _mm256_fmadd_ps(nx, nx, _mm256_fmadd_ps(ny, ny, _mm256_mul_ps(nz, nz)));
+        __m256 r = _mm256_rsqrt_ps(lengthSquared);
+        __m256 rr = _mm256_mul_ps(r, r);
+        r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, lengthSquared), rr, threeHalves));
+
+        _mm256_store_ps(normal[0], _mm256_mul_ps(nx, r));
+        _mm256_store_ps(normal[1], _mm256_mul_ps(ny, r));
+        _mm256_store_ps(normal[2], _mm256_mul_ps(nz, r));
+        float* target = out + i * 3;
+        for (int k = 0; k < 8; ++k) {
+            target[k * 3] = normal[0][k];
+            target[k * 3 + 1] = normal[1][k];
+            target[k * 3 + 2] = normal[2][k];
+        }
+    }
+    faceNormalsScalar(i, end);
+}
+#endif
+
+#if defined(__aarch64__)
+// 4 triangulos por iteracao; NEON nao tem gather, entao as posicoes sao
+// transpostas para SoA ao carregar.
+void faceNormalsNEON(size_t begin, size_t end) {
+    float* out = triangleNormals.data();
+    alignas(16) float p[9][4];
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        for (int k = 0; k < 4; ++k) {
+            const Triangle& face = triangles[i + k];
+            const Vertex* corners[3] = {&vertices[face.v1], &vertices[face.v2], &vertices[face.v3]};
+            for (int c = 0; c < 3; ++c) {
+                p[c * 3][k] = corners[c]->x;
+                p[c * 3 + 1][k] = corners[c]->y;
+                p[c * 3 + 2][k] = corners[c]->z;
+            }
+        }
+        float32x4_t ax = vld1q_f32(p[0]), ay = vld1q_f32(p[1]), az = vld1q_f32(p[2]);
+        float32x4_t ux = vsubq_f32(vld1q_f32(p[3]), ax);
+        float32x4_t uy = vsubq_f32(vld1q_f32(p[4]), ay);
+        float32x4_t uz = vsubq_f32(vld1q_f32(p[5]), az);
+        float32x4_t vx = vsubq_f32(vld1q_f32(p[6]), ax);
+        float32x4_t vy = vsubq_f32(vld1q_f32(p[7]), ay);
+        float32x4_t vz = vsubq_f32(vld1q_f32(p[8]), az);
+
+        float32x4x3_t n;
+        n.val[0] = vfmsq_f32(vmulq_f32(uy, vz), uz, vy);
+        n.val[1] = vfmsq_f32(vmulq_f32(uz, vx), ux, vz);
+        n.val[2] = vfmsq_f32(vmulq_f32(ux, vy), uy, vx);
+
+        float32x4_t lengthSquared =
+                vfmaq_f32(vfmaq_f32(vmulq_f32(n.val[2], n.val[2]), n.val[1], n.val[1]), n.val[0], n.val[0]);
+        float32x4_t r = vrsqrteq_f32(lengthSquared);
+        r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(lengthSquared, r), r));
+        n.val[0] = vmulq_f32(n.val[0], r);
+        n.val[1] = vmulq_f32(n.val[1], r);
+        n.val[2] = vmulq_f32(n.val[2], r);
+        vst3q_f32(out + i * 3, n);
+    }
+    faceNormalsScalar(i, end);
+}
+#endif
+
+using FaceNormalKernel = void (*)(size_t, size_t);
+
+// false forca o kernel escalar (--no-simd).
+bool simdEnabled = true;
+
+// Escolhe o kernel de normais pela CPU em que o programa esta rodando.
+FaceNormalKernel faceNormalKernel() {
+    if (!simdEnabled) {
+        return faceNormalsScalar;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return faceNormalsAVX2;
+    }
+#elif defined(__aarch64__)
+    return faceNormalsNEON;
+#endif
+    return faceNormalsScalar;
+}
+
+void calculateFaceNormals() {
+    triangleNormals.resize(triangles.size() * 3);
+    FaceNormalKernel kernel = faceNormalKernel();
+    parallelFor(triangles.size(), 1 << 16, [kernel](size_t begin, size_t end) {
+        kernel(begin, end);
+    });
+}
+// Monta vertexTriangleOffsets/vertexTriangles a partir de triangles com uma
+// contagem por vertice, soma de prefixos e preenchimento em ordem de triangulo.
+// Precisa ser refeita sempre que triangles mudar.
+void buildVertexAdjacency() {
+    size_t vertexCount = vertices.size();
+    vertexTriangleOffsets.assign(vertexCount + 1, 0);
+    for (const auto& face : triangles) {
+        ++vertexTriangleOffsets[face.v1 + 1];
+        ++vertexTriangleOffsets[face.v2 + 1];
+        ++vertexTriangleOffsets[face.v3 + 1];
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        vertexTriangleOffsets[v + 1] += vertexTriangleOffsets[v];
+    }
+    vertexTriangles.resize(triangles.size() * 3);
+    std::vector<uint32_t> cursor(vertexTriangleOffsets.begin(), vertexTriangleOffsets.end() - 1);
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const Triangle& face = triangles[i];
+        vertexTriangles[cursor[face.v1]++] = static_cast<uint32_t>(i);
+        vertexTriangles[cursor[face.v2]++] = static_cast<uint32_t>(i);
+        vertexTriangles[cursor[face.v3]++] = static_cast<uint32_t>(i);
+    }
+}
+
+bool vertexAdjacencyIsCurrent() {
+    return vertexTriangleOffsets.size() == vertices.size() + 1 && vertexTriangles.size() == triangles.size() * 3;
+}
+
+// Vizinhos w > v de um vertice, sem repeticao, tirados da adjacencia.
+void collectEdgeNeighbors(uint32_t v, std::vector<uint32_t>& neighbors) {
+    neighbors.clear();
+    for (uint32_t k = vertexTriangleOffsets[v]; k < vertexTriangleOffsets[v + 1]; ++k) {
+        const Triangle& face = triangles[vertexTriangles[k]];
+        for (int w : {face.v1, face.v2, face.v3}) {
+            if (static_cast<uint32_t>(w) > v) {
+                neighbors.push_back(static_cast<uint32_t>(w));
+            }
+        }
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+}
+
+// Cada vertice v e dono das arestas (v, w) com w > v, entao cada aresta sai
+// uma vez so e os vertices podem ser processados em paralelo: uma passada
+// conta, a soma de prefixos da a posicao de cada vertice e outra escreve.
+// Exige a adjacencia vertice -> triangulos atualizada.
+void buildMeshEdges() {
+    size_t vertexCount = vertices.size();
+    std::vector<uint32_t> edgeOffsets(vertexCount + 1, 0);
+    parallelFor(vertexCount, 4096, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> neighbors;
+        for (size_t v = begin; v < end; ++v) {
+            collectEdgeNeighbors(static_cast<uint32_t>(v), neighbors);
+            edgeOffsets[v + 1] = static_cast<uint32_t>(neighbors.size());
+        }
+    });
+    for (size_t v = 0; v < vertexCount; ++v) {
+        edgeOffsets[v + 1] += edgeOffsets[v];
+    }
+    edgeIndices.resize(static_cast<size_t>(edgeOffsets[vertexCount]) * 2);
+    parallelFor(vertexCount, 4096, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> neighbors;
+        for (size_t v = begin; v < end; ++v) {
+            collectEdgeNeighbors(static_cast<uint32_t>(v), neighbors);
+            uint32_t* out = &edgeIndices[static_cast<size_t>(edgeOffsets[v]) * 2];
+            for (uint32_t w : neighbors) {
+                *out++ = static_cast<uint32_t>(v);
+                *out++ = w;
+            }
+        }
+    });
+}
+
+// BVH sobre os triangulos, em um vetor plano de nos de 32 bytes. Um no
+// interno tem count == 0 e os filhos em first e first + 1; uma folha cobre
+// bvhTriangles[first] ate bvhTriangles[first + count - 1]. Os filhos sempre
+// ficam depois do pai no vetor, o que permite o refit numa passada reversa.
+struct BVHNode {
+    float boundsMin[3];
+    uint32_t first;
+    float boundsMax[3];
+    uint32_t count;
+};
+
+std::vector<BVHNode> bvhNodes;
+std::vector<uint32_t> bvhTriangles;
+uint64_t bvhVersion = 0;
+
+const int bvhBinCount = 12;
+const uint32_t bvhMaxLeafTriangles = 16;
+// Custo de visitar um no em relacao ao de testar um triangulo.
+const float bvhTraversalCost = 1.0f;
+
+struct BVHBounds {
+    float min[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max()};
+    float max[3] = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest()};
+
+    void grow(const float* point) {
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = std::min(min[axis], point[axis]);
+            max[axis] = std::max(max[axis], point[axis]);
+        }
+    }
+
+    void grow(const BVHBounds& other) {
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = std::min(min[axis], other.min[axis]);
+            max[axis] = std::max(max[axis], other.max[axis]);
+        }
+    }
+
+    float area() const {
+        float dx = max[0] - min[0];
+        float dy = max[1] - min[1];
+        float dz = max[2] - min[2];
+        if (dx < 0.0f) {
+            return 0.0f;
+        }
+        return dx * dy + dy * dz + dz * dx;
+    }
+};
+
+BVHBounds triangleBounds(uint32_t t) {
+    const Triangle& face = triangles[t];
+    BVHBounds bounds;
+    bounds.grow(&vertices[face.v1].x);
+    bounds.grow(&vertices[face.v2].x);
+    bounds.grow(&vertices[face.v3].x);
+    return bounds;
+}
+
+void setNodeBounds(BVHNode& node, const BVHBounds& bounds) {
+    std::copy(bounds.min, bounds.min + 3, node.boundsMin);
+    std::copy(bounds.max, bounds.max + 3, node.boundsMax);
+}
+
+// Estado da construcao: caixas e centroides de cada triangulo, calculados uma
+// vez em paralelo.
+struct BVHBuildInput {
+    std::vector<BVHBounds> bounds;
+    std::vector<float> centroids;
+};
+
+// Divide nodes[index] pelo melhor plano SAH entre bvhBinCount caixas por eixo
+// e devolve false se virar folha. Os filhos sao anexados ao fim de nodes.
+bool splitBVHNode(std::vector<BVHNode>& nodes, uint32_t index, const BVHBuildInput& input) {
+    uint32_t first = nodes[index].first;
+    uint32_t count = nodes[index].count;
+    if (count <= 2) {
+        return false;
+    }
+    BVHBounds centroidBounds;
+    for (uint32_t i = first; i < first + count; ++i) {
+        centroidBounds.grow(&input.centroids[bvhTriangles[i] * 3]);
+    }
+
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    int bestSplit = 0;
+    BVHBounds bestLeft;
+    BVHBounds bestRight;
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+        float scale = bvhBinCount / extent;
+        BVHBounds binBounds[bvhBinCount];
+        uint32_t binCounts[bvhBinCount] = {};
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t t = bvhTriangles[i];
+            int bin = std::min(bvhBinCount - 1,
+                               static_cast<int>((input.centroids[t * 3 + axis] - centroidBounds.min[axis]) * scale));
+            ++binCounts[bin];
+            binBounds[bin].grow(input.bounds[t]);
+        }
+        BVHBounds leftBounds[bvhBinCount - 1];
+        uint32_t leftCount[bvhBinCount - 1];
+        BVHBounds sweep;
+        uint32_t sweepCount = 0;
+        for (int i = 0; i < bvhBinCount - 1; ++i) {
+            sweep.grow(binBounds[i]);
+            sweepCount += binCounts[i];
+            leftBounds[i] = sweep;
+            leftCount[i] = sweepCount;
+        }
+        sweep = BVHBounds();
+        sweepCount = 0;
+        for (int i = bvhBinCount - 1; i > 0; --i) {
+            sweep.grow(binBounds[i]);
+            sweepCount += binCounts[i];
+            float cost = leftBounds[i - 1].area() * leftCount[i - 1] + sweep.area() * sweepCount;
+            if (leftCount[i - 1] > 0 && sweepCount > 0 && cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+                bestLeft = leftBounds[i - 1];
+                bestRight = sweep;
+            }
+        }
+    }
+
+    BVHBounds nodeBounds;
+    nodeBounds.grow(nodes[index].boundsMin);
+    nodeBounds.grow(nodes[index].boundsMax);
+    float nodeArea = nodeBounds.area();
+    if (bestAxis < 0 || (count <= bvhMaxLeafTriangles && bestCost + bvhTraversalCost * nodeArea >= nodeArea * count)) {
+        return false;
+    }
+
+    float scale = bvhBinCount / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+    uint32_t* begin = bvhTriangles.data() + first;
+    uint32_t* middle = std::partition(begin, begin + count, [&](uint32_t t) {
+        int bin = std::min(bvhBinCount - 1,
+                           static_cast<int>((input.centroids[t * 3 + bestAxis] - centroidBounds.min[bestAxis]) * scale));
+        return bin < bestSplit;
+    });
+    uint32_t leftCount = static_cast<uint32_t>(middle - begin);
+
+    uint32_t childIndex = static_cast<uint32_t>(nodes.size());
+    BVHNode left{};
+    left.first = first;
+    left.count = leftCount;
+    setNodeBounds(left, bestLeft);
+    BVHNode right{};
+    right.first = first + leftCount;
+    right.count = count - leftCount;
+    setNodeBounds(right, bestRight);
+    nodes[index].first = childIndex;
+    nodes[index].count = 0;
+    nodes.push_back(left);
+    nodes.push_back(right);
+    return true;
+}
+
+void buildBVHSubtree(std::vector<BVHNode>& nodes, uint32_t root, const BVHBuildInput& input) {
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        stack.pop_back();
+        if (splitBVHNode(nodes, index, input)) {
+            stack.push_back(nodes[index].first);
+            stack.push_back(nodes[index].first + 1);
+        }
+    }
+}
+
+// Constroi a BVH com SAH por caixas. Os niveis de cima sao divididos em serie
+// ate haver subarvores suficientes para todas as threads; cada subarvore e
+// construida em paralelo num vetor proprio (as faixas de bvhTriangles sao
+// disjuntas) e depois emendada no vetor global com os indices corrigidos.
+void buildBVH() {
+    uint32_t triangleCount = static_cast<uint32_t>(triangles.size());
+    bvhNodes.clear();
+    bvhTriangles.resize(triangleCount);
+    if (triangleCount == 0) {
+        bvhVersion = geometryVersion;
+        return;
+    }
+    BVHBuildInput input;
+    input.bounds.resize(triangleCount);
+    input.centroids.resize(static_cast<size_t>(triangleCount) * 3);
+    parallelFor(triangleCount, 16384, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            bvhTriangles[t] = static_cast<uint32_t>(t);
+            input.bounds[t] = triangleBounds(static_cast<uint32_t>(t));
+            for (int axis = 0; axis < 3; ++axis) {
+                input.centroids[t * 3 + axis] = 0.5f * (input.bounds[t].min[axis] + input.bounds[t].max[axis]);
+            }
+        }
+    });
+    BVHBounds rootBounds;
+    for (const BVHBounds& bounds : input.bounds) {
+        rootBounds.grow(bounds);
+    }
+    BVHNode root{};
+    root.first = 0;
+    root.count = triangleCount;
+    setNodeBounds(root, rootBounds);
+    bvhNodes.reserve(triangleCount / 2 + 1);
+    bvhNodes.push_back(root);
+
+    size_t wantedSubtrees = static_cast<size_t>(threadPool().size()) * 4;
+    uint32_t minSubtreeTriangles = 4096;
+    std::vector<uint32_t> subtrees = {0};
+    while (subtrees.size() < wantedSubtrees) {
+        auto largest = std::max_element(subtrees.begin(), subtrees.end(), [](uint32_t a, uint32_t b) {
+            return bvhNodes[a].count < bvhNodes[b].count;
+        });
+        uint32_t index = *largest;
+        if (bvhNodes[index].count < minSubtreeTriangles || !splitBVHNode(bvhNodes, index, input)) {
+            break;
+        }
+        *largest = bvhNodes[index].first;
+        subtrees.push_back(bvhNodes[index].first + 1);
+    }
+
+    std::vector<std::vector<BVHNode>> subtreeNodes(subtrees.size());
+    threadPool().run(subtrees.size(), [&](size_t s) {
+        subtreeNodes[s].push_back(bvhNodes[subtrees[s]]);
+        buildBVHSubtree(subtreeNodes[s], 0, input);
+    });
+    for (size_t s = 0; s < subtrees.size(); ++s) {
+        const std::vector<BVHNode>& local = subtreeNodes[s];
+        uint32_t base = static_cast<uint32_t>(bvhNodes.size()) - 1;
+        for (size_t i = 1; i < local.size(); ++i) {
+            BVHNode node = local[i];
+            if (node.count == 0) {
+                node.first += base;
+            }
+            bvhNodes.push_back(node);
+        }
+        BVHNode subtreeRoot = local[0];
+        if (subtreeRoot.count == 0) {
+            subtreeRoot.first += base;
+        }
+        bvhNodes[subtrees[s]] = subtreeRoot;
+    }
+    bvhVersion = geometryVersion;
+}
+
+// Atualiza as caixas sem mudar a topologia, para quando os vertices se movem
+// mas os triangulos sao os mesmos: folhas em paralelo, depois os nos internos
+// de tras para frente.
+void refitBVH() {
+    parallelFor(bvhNodes.size(), 4096, [](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            BVHNode& node = bvhNodes[i];
+            if (node.count == 0) {
+                continue;
+            }
+            BVHBounds bounds;
+            for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+                bounds.grow(triangleBounds(bvhTriangles[k]));
+            }
+            setNodeBounds(node, bounds);
+        }
+    });
+    for (size_t i = bvhNodes.size(); i-- > 0;) {
+        BVHNode& node = bvhNodes[i];
+        if (node.count != 0) {
+            continue;
+        }
+        const BVHNode& left = bvhNodes[node.first];
+        const BVHNode& right = bvhNodes[node.first + 1];
+        for (int axis = 0; axis < 3; ++axis) {
+            node.boundsMin[axis] = std::min(left.boundsMin[axis], right.boundsMin[axis]);
+            node.boundsMax[axis] = std::max(left.boundsMax[axis], right.boundsMax[axis]);
+        }
+    }
+    bvhVersion = geometryVersion;
+}
+
+// As consultas refazem as caixas se a geometria mudou desde a ultima vez.
+void updateBVH() {
+    if (bvhVersion != geometryVersion && !bvhNodes.empty()) {
+        refitBVH();
+    }
+}
+
+// Triangulos cuja caixa cruza a caixa [boundsMin, boundsMax].
+void queryBVHBounds(const float boundsMin[3], const float boundsMax[3], std::vector<uint32_t>& result) {
+    updateBVH();
+    result.clear();
+    if (bvhNodes.empty()) {
+        return;
+    }
+    auto overlaps = [&](const float* nodeMin, const float* nodeMax) {
+        return nodeMin[0] <= boundsMax[0] && nodeMax[0] >= boundsMin[0] && nodeMin[1] <= boundsMax[1] &&
+               nodeMax[1] >= boundsMin[1] && nodeMin[2] <= boundsMax[2] && nodeMax[2] >= boundsMin[2];
+    };
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        const BVHNode& node = bvhNodes[stack.back()];
+        stack.pop_back();
+        if (!overlaps(node.boundsMin, node.boundsMax)) {
+            continue;
+        }
+        if (node.count == 0) {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+        for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+            BVHBounds bounds = triangleBounds(bvhTriangles[k]);
+            if (overlaps(bounds.min, bounds.max)) {
+                result.push_back(bvhTriangles[k]);
+            }
+        }
+    }
+}
+
+// Posicao de uma caixa em relacao a um plano (a, b, c, d), com o lado de
+// dentro em ax + by + cz + d >= 0: -1 fora, 1 dentro, 0 cruzando.
+int classifyBounds(const float plane[4], const float* boundsMin, const float* boundsMax) {
+    float nearPoint = plane[3];
+    float farPoint = plane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        if (plane[axis] >= 0.0f) {
+            nearPoint += plane[axis] * boundsMin[axis];
+            farPoint += plane[axis] * boundsMax[axis];
+        } else {
+            nearPoint += plane[axis] * boundsMax[axis];
+            farPoint += plane[axis] * boundsMin[axis];
+        }
+    }
+    if (farPoint < 0.0f) {
+        return -1;
+    }
+    return nearPoint >= 0.0f ? 1 : 0;
+}
+
+// Triangulos cuja caixa nao esta inteiramente fora de algum dos planos. Uma
+// subarvore inteira dentro do frustum entra sem mais testes.
+void queryBVHFrustum(const float planes[6][4], std::vector<uint32_t>& result) {
+    updateBVH();
+    result.clear();
+    if (bvhNodes.empty()) {
+        return;
+    }
+    std::vector<std::pair<uint32_t, bool>> stack = {{0, false}};
+    while (!stack.empty()) {
+        auto [index, inside] = stack.back();
+        stack.pop_back();
+        const BVHNode& node = bvhNodes[index];
+        if (!inside) {
+            bool outside = false;
+            inside = true;
+            for (int p = 0; p < 6 && !outside; ++p) {
+                int side = classifyBounds(planes[p], node.boundsMin, node.boundsMax);
+                outside = side < 0;
+                inside = inside && side > 0;
+            }
+            if (outside) {
+                continue;
+            }
+        }
+        if (node.count == 0) {
+            stack.push_back({node.first, inside});
+            stack.push_back({node.first + 1, inside});
+            continue;
+        }
+        result.insert(result.end(), bvhTriangles.begin() + node.first, bvhTriangles.begin() + node.first + node.count);
+    }
+}
+
+// Moller-Trumbore: distancia ao longo do raio ate o triangulo t, ou infinito.
+float intersectTriangle(const float origin[3], const float direction[3], uint32_t t) {
+    const Triangle& face = triangles[t];
+    const Vertex& a = vertices[face.v1];
+    const Vertex& b = vertices[face.v2];
+    const Vertex& c = vertices[face.v3];
+    float e1[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+    float e2[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+    float p[3] = {direction[1] * e2[2] - direction[2] * e2[1], direction[2] * e2[0] - direction[0] * e2[2],
+                  direction[0] * e2[1] - direction[1] * e2[0]};
+    float determinant = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    const float miss = std::numeric_limits<float>::infinity();
+    if (std::fabs(determinant) < 1e-12f) {
+        return miss;
+    }
+    float inverse = 1.0f / determinant;
+    float s[3] = {origin[0] - a.x, origin[1] - a.y, origin[2] - a.z};
+    float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverse;
+    if (u < 0.0f || u > 1.0f) {
+        return miss;
+    }
+    float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+    float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inverse;
+    if (v < 0.0f || u + v > 1.0f) {
+        return miss;
+    }
+    float distance = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inverse;
+    return distance > 0.0f ? distance : miss;
+}
+
+// Triangulo mais proximo atingido pelo raio origin + d * direction com d em
+// (0, distance). Em caso de acerto atualiza distance e triangle. Os filhos
+// sao visitados do mais proximo para o mais distante.
+bool raycastBVH(const float origin[3], const float direction[3], float& distance, uint32_t& triangle) {
+    updateBVH();
+    if (bvhNodes.empty()) {
+        return false;
+    }
+    float inverse[3] = {1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]};
+    auto entry = [&](const BVHNode& node) {
+        float near = 0.0f;
+        float far = distance;
+        for (int axis = 0; axis < 3; ++axis) {
+            // Raio paralelo ao eixo: so cruza a faixa se a origem ja esta nela
+            // (0 * inf daria NaN no teste abaixo).
+            if (direction[axis] == 0.0f) {
+                if (origin[axis] < node.boundsMin[axis] || origin[axis] > node.boundsMax[axis]) {
+                    return std::numeric_limits<float>::infinity();
+                }
+                continue;
+            }
+            float t1 = (node.boundsMin[axis] - origin[axis]) * inverse[axis];
+            float t2 = (node.boundsMax[axis] - origin[axis]) * inverse[axis];
+            near = std::max(near, std::min(t1, t2));
+            far = std::min(far, std::max(t1, t2));
+        }
+        return near <= far ? near : std::numeric_limits<float>::infinity();
+    };
+    bool hit = false;
+    std::vector<std::pair<uint32_t, float>> stack = {{0, entry(bvhNodes[0])}};
+    while (!stack.empty()) {
+        auto [index, near] = stack.back();
+        stack.pop_back();
+        if (near > distance) {
+            continue;
+        }
+        const BVHNode& node = bvhNodes[index];
+        if (node.count > 0) {
+            for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+                float d = intersectTriangle(origin, direction, bvhTriangles[k]);
+                if (d < distance) {
+                    distance = d;
+                    triangle = bvhTriangles[k];
+                    hit = true;
+                }
+            }
+            continue;
+        }
+        float leftNear = entry(bvhNodes[node.first]);
+        float rightNear = entry(bvhNodes[node.first + 1]);
+        if (leftNear <= rightNear) {
+            stack.push_back({node.first + 1, rightNear});
+            stack.push_back({node.first, leftNear});
+        } else {
+            stack.push_back({node.first, leftNear});
+            stack.push_back({node.first + 1, rightNear});
+        }
+    }
+    return hit;
+}
+
+// Clusters: o corte da BVH em subarvores de ate clusterTriangles triangulos.
+// Cada cluster cobre uma faixa continua de bvhTriangles e de drawTriangleOrder,
+// a ordem dos triangulos no buffer de indices da GPU, e uma faixa de
+// edgeIndices, que fica agrupado por cluster. Suas caixas sao as dos nos da BVH, entao o refit as
+// mantem corretas depois de uma transformacao.
+struct MeshCluster {
+    uint32_t node;
+    uint32_t firstTriangle;
+    uint32_t triangleCount;
+    uint32_t firstEdge;
+    uint32_t edgeCount;
+};
+
+const uint32_t clusterTriangles = 1024;
+std::vector<MeshCluster> meshClusters;
+// bvhTriangles com cada faixa de cluster em ordem crescente, o que preserva
+// dentro do cluster a ordem de cache de optimizeMeshOrder().
+std::vector<uint32_t> drawTriangleOrder;
+
+// Caixas dos clusters em SoA (centro e meia extensao por eixo) para o teste
+// contra os planos do frustum, com o tamanho arredondado para multiplo de 8.
+struct ClusterBounds {
+    AlignedFloats center[3];
+    AlignedFloats extent[3];
+};
+
+ClusterBounds clusterBounds;
+uint64_t clusterBoundsVersion = 0;
+
+void buildMeshClusters() {
+    meshClusters.clear();
+    drawTriangleOrder.clear();
+    if (bvhNodes.empty()) {
+        return;
+    }
+    // Faixa de bvhTriangles coberta por cada no; os filhos vem depois do pai.
+    std::vector<uint32_t> rangeFirst(bvhNodes.size());
+    std::vector<uint32_t> rangeCount(bvhNodes.size());
+    for (size_t i = bvhNodes.size(); i-- > 0;) {
+        const BVHNode& node = bvhNodes[i];
+        if (node.count > 0) {
+            rangeFirst[i] = node.first;
+            rangeCount[i] = node.count;
+        } else {
+            rangeFirst[i] = rangeFirst[node.first];
+            rangeCount[i] = rangeCount[node.first] + rangeCount[node.first + 1];
+        }
+    }
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        stack.pop_back();
+        const BVHNode& node = bvhNodes[index];
+        if (node.count > 0 || rangeCount[index] <= clusterTriangles) {
+            meshClusters.push_back({index, rangeFirst[index], rangeCount[index], 0, 0});
+            continue;
+        }
+        stack.push_back(node.first + 1);
+        stack.push_back(node.first);
+    }
+    drawTriangleOrder = bvhTriangles;
+    for (const MeshCluster& cluster : meshClusters) {
+        auto first = drawTriangleOrder.begin() + cluster.firstTriangle;
+        std::sort(first, first + cluster.triangleCount);
+    }
+
+    // Cada aresta vai para o cluster de um triangulo que a contem.
+    std::vector<uint32_t> triangleCluster(triangles.size());
+    for (uint32_t c = 0; c < meshClusters.size(); ++c) {
+        const MeshCluster& cluster = meshClusters[c];
+        for (uint32_t k = cluster.firstTriangle; k < cluster.firstTriangle + cluster.triangleCount; ++k) {
+            triangleCluster[bvhTriangles[k]] = c;
+        }
+    }
+    size_t edgeCount = edgeIndices.size() / 2;
+    std::vector<uint32_t> edgeCluster(edgeCount);
+    parallelFor(edgeCount, 16384, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; ++e) {
+            int a = static_cast<int>(edgeIndices[e * 2]);
+            int b = static_cast<int>(edgeIndices[e * 2 + 1]);
+            for (uint32_t k = vertexTriangleOffsets[a]; k < vertexTriangleOffsets[a + 1]; ++k) {
+                const Triangle& face = triangles[vertexTriangles[k]];
+                if (face.v1 == b || face.v2 == b || face.v3 == b) {
+                    edgeCluster[e] = triangleCluster[vertexTriangles[k]];
+                    break;
+                }
+            }
+        }
+    });
+    for (uint32_t c : edgeCluster) {
+        ++meshClusters[c].edgeCount;
+    }
+    for (size_t c = 1; c < meshClusters.size(); ++c) {
+        meshClusters[c].firstEdge = meshClusters[c - 1].firstEdge + meshClusters[c - 1].edgeCount;
+    }
+    std::vector<uint32_t> clusteredEdges(edgeIndices.size());
+    std::vector<uint32_t> cursor(meshClusters.size());
+    for (size_t c = 0; c < meshClusters.size(); ++c) {
+        cursor[c] = meshClusters[c].firstEdge;
+    }
+    for (size_t e = 0; e < edgeCount; ++e) {
+        uint32_t slot = cursor[edgeCluster[e]]++;
+        clusteredEdges[slot * 2] = edgeIndices[e * 2];
+        clusteredEdges[slot * 2 + 1] = edgeIndices[e * 2 + 1];
+    }
+    edgeIndices.swap(clusteredEdges);
+    clusterBoundsVersion = 0;
+}
+
+void updateClusterBounds() {
+    updateBVH();
+    if (clusterBoundsVersion == bvhVersion) {
+        return;
+    }
+    size_t padded = (meshClusters.size() + 7) & ~size_t(7);
+    for (int axis = 0; axis < 3; ++axis) {
+        clusterBounds.center[axis].assign(padded, 0.0f);
+        clusterBounds.extent[axis].assign(padded, 0.0f);
+    }
+    for (size_t c = 0; c < meshClusters.size(); ++c) {
+        const BVHNode& node = bvhNodes[meshClusters[c].node];
+        for (int axis = 0; axis < 3; ++axis) {
+            clusterBounds.center[axis][c] = 0.5f * (node.boundsMin[axis] + node.boundsMax[axis]);
+            clusterBounds.extent[axis][c] = 0.5f * (node.boundsMax[axis] - node.boundsMin[axis]);
+        }
+    }
+    clusterBoundsVersion = bvhVersion;
+}
+
+// Marca em visible (com OU) os clusters que nao estao inteiramente fora de
+// nenhum dos seis planos: a caixa esta fora se n.c + d + |n|.e < 0.
+void cullClustersScalar(const float planes[6][4], size_t begin, size_t end, uint8_t* visible) {
+    for (size_t c = begin; c < end; ++c) {
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; ++p) {
+            const float* plane = planes[p];
+            float distance = plane[3];
+            float radius = 0.0f;
+            for (int axis = 0; axis < 3; ++axis) {
+                distance += plane[axis] * clusterBounds.center[axis][c];
+                radius += std::fabs(plane[axis]) * clusterBounds.extent[axis][c];
+            }
+            outside = distance + radius < 0.0f;
+        }
+        visible[c] |= outside ? 0 : 1;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) void cullClustersAVX2(const float planes[6][4], size_t begin, size_t end,
+                                                           uint8_t* visible) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    size_t c = begin;
+    for (; c + 8 <= end; c += 8) {
+        __m256 center[3];
+        __m256 extent[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            center[axis] = _mm256_loadu_ps(&clusterBounds.center[axis][c]);
+            extent[axis] = _mm256_loadu_ps(&clusterBounds.extent[axis][c]);
+        }
+        __m256 outside = zero;
+        for (int p = 0; p < 6; ++p) {
+            __m256 distance = _mm256_set1_ps(planes[p][3]);
+            __m256 radius = zero;
+            for (int axis = 0; axis < 3; ++axis) {
+                __m256 n = _mm256_set1_ps(planes[p][axis]);
+                distance = _mm256_fmadd_ps(n, center[axis], distance);
+                radius = _mm256_fmadd_ps(_mm256_andnot_ps(signMask, n), extent[axis], radius);
+            }
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_LT_OQ));
+        }
+        int mask = _mm256_movemask_ps(outside);
+        for (int k = 0; k < 8; ++k) {
+            visible[c + k] |= ((mask >> k) & 1) ^ 1;
+        }
+    }
+    cullClustersScalar(planes, c, end, visible);
+}
+#endif
+
+#if defined(__aarch64__)
+void cullClustersNEON(const float planes[6][4], size_t begin, size_t end, uint8_t* visible) {
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    size_t c = begin;
+    for (; c + 4 <= end; c += 4) {
+        float32x4_t center[3];
+        float32x4_t extent[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            center[axis] = vld1q_f32(&clusterBounds.center[axis][c]);
+            extent[axis] = vld1q_f32(&clusterBounds.extent[axis][c]);
+        }
+        uint32x4_t outside = vdupq_n_u32(0);
+        for (int p = 0; p < 6; ++p) {
+            float32x4_t distance = vdupq_n_f32(planes[p][3]);
+            float32x4_t radius = zero;
+            for (int axis = 0; axis < 3; ++axis) {
+                distance = vfmaq_n_f32(distance, center[axis], planes[p][axis]);
+                radius = vfmaq_n_f32(radius, extent[axis], std::fabs(planes[p][axis]));
+            }
+            outside = vorrq_u32(outside, vcltq_f32(vaddq_f32(distance, radius), zero));
+        }
+        visible[c] |= vgetq_lane_u32(outside, 0) ? 0 : 1;
+        visible[c + 1] |= vgetq_lane_u32(outside, 1) ? 0 : 1;
+        visible[c + 2] |= vgetq_lane_u32(outside, 2) ? 0 : 1;
+        visible[c + 3] |= vgetq_lane_u32(outside, 3) ? 0 : 1;
+    }
+    cullClustersScalar(planes, c, end, visible);
+}
+#endif
+
+using CullKernel = void (*)(const float (*)[4], size_t, size_t, uint8_t*);
+
+CullKernel cullKernel() {
+    if (!simdEnabled) {
+        return cullClustersScalar;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return cullClustersAVX2;
+    }
+#elif defined(__aarch64__)
+    return cullClustersNEON;
+#endif
+    return cullClustersScalar;
+}
+
+// Planos do frustum no espaco do modelo a partir da matriz modelo -> recorte
+// (coluna maior), com o lado de dentro positivo; nao precisam ser normalizados
+// para o teste de sinal.
+void extractFrustumPlanes(const Matrix4& clip, float planes[6][4]) {
+    const GLfloat* m = clip.m;
+    for (int i = 0; i < 3; ++i) {
+        for (int k = 0; k < 4; ++k) {
+            planes[i * 2][k] = m[k * 4 + 3] + m[k * 4 + i];
+            planes[i * 2 + 1][k] = m[k * 4 + 3] - m[k * 4 + i];
+        }
+    }
+}
+
+// Niveis de detalhe: buffers de indices cada vez menores sobre os mesmos
+// vertices, gerados por colapso de arestas com metrica de erro quadrica
+// (Garland-Heckbert). O vertice removido vai para a posicao do que fica, entao
+// os niveis reaproveitam o buffer de vertices e de normais da GPU.
+struct LODLevel {
+    uint32_t firstIndex;
+    uint32_t triangleCount;
+    float error;
+};
+
+const float lodTargets[] = {0.5f, 0.25f, 0.12f, 0.06f};
+// false nao gera nem usa os niveis (--no-lod).
+bool lodEnabled = true;
+// Escritos so pela thread de simplificacao antes de lodReady.
+std::vector<LODLevel> lodLevels;
+std::vector<uint32_t> lodIndices;
+std::atomic<bool> lodReady{false};
+std::atomic<bool> lodCancel{false};
+std::thread lodThread;
+
+// Quadrica simetrica 4x4 guardada pelo triangulo de cima:
+// aa ab ac ad bb bc bd cc cd dd.
+struct Quadric {
+    double q[10] = {};
+
+    void addPlane(double a, double b, double c, double d, double weight) {
+        q[0] += weight * a * a;
+        q[1] += weight * a * b;
+        q[2] += weight * a * c;
+        q[3] += weight * a * d;
+        q[4] += weight * b * b;
+        q[5] += weight * b * c;
+        q[6] += weight * b * d;
+        q[7] += weight * c * c;
+        q[8] += weight * c * d;
+        q[9] += weight * d * d;
+    }
+
+    void add(const Quadric& other) {
+        for (int i = 0; i < 10; ++i) {
+            q[i] += other.q[i];
+        }
+    }
+
+    double error(const Vertex& p) const {
+        double x = p.x;
+        double y = p.y;
+        double z = p.z;
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x + q[4] * y * y +
+               2 * q[5] * y * z + 2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+    }
+};
+
+struct EdgeCollapse {
+    double cost;
+    uint32_t from;
+    uint32_t to;
+    uint32_t fromStamp;
+    uint32_t toStamp;
+
+    bool operator>(const EdgeCollapse& other) const {
+        return cost > other.cost;
+    }
+};
+
+// Normal (sem normalizar) do triangulo a, b, c.
+void triangleCross(const Vertex& a, const Vertex& b, const Vertex& c, double n[3]) {
+    double e1[3] = {b.x - a.x, b.y - a.y, b.z - a.z};
+    double e2[3] = {c.x - a.x, c.y - a.y, c.z - a.z};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Simplifica a copia (positions, faces) e anexa um nivel em levels/indices a
+// cada alvo de lodTargets atingido. Cada colapso leva o vertice "from" para
+// "to"; candidatos ficam num heap com carimbos por vertice, e os que ficaram
+// velhos sao descartados ao sair. Colapsos que virariam algum triangulo ou que
+// quebrariam a topologia (condicao de enlace) sao recusados, e arestas de
+// borda recebem planos perpendiculares com peso alto para a silhueta aberta
+// nao encolher.
+void simplifyMesh(const std::vector<Vertex>& positions, std::vector<Triangle> faces, std::vector<LODLevel>& levels,
+                  std::vector<uint32_t>& indices) {
+    size_t vertexCount = positions.size();
+    std::vector<Quadric> quadrics(vertexCount);
+    for (uint32_t t = 0; t < faces.size(); ++t) {
+        const Triangle& face = faces[t];
+        double n[3];
+        triangleCross(positions[face.v1], positions[face.v2], positions[face.v3], n);
+        double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length > 0.0) {
+            double a = n[0] / length;
+            double b = n[1] / length;
+            double c = n[2] / length;
+            const Vertex& p = positions[face.v1];
+            double d = -(a * p.x + b * p.y + c * p.z);
+            for (int v : {face.v1, face.v2, face.v3}) {
+                quadrics[v].addPlane(a, b, c, d, 0.5 * length);
+            }
+        }
+    }
+
+    // Triangulos de cada vertice em CSR, como em buildVertexAdjacency: a faixa
+    // de v e [faceBegin[v], faceBegin[v] + faceCount[v]) em vertexFaces. Quando
+    // os triangulos juntados por um colapso nao cabem na faixa do vertice que
+    // fica, a lista nova vai para o fim de vertexFaces e a antiga e abandonada.
+    std::vector<uint32_t> faceBegin(vertexCount + 1, 0);
+    for (const Triangle& face : faces) {
+        ++faceBegin[face.v1 + 1];
+        ++faceBegin[face.v2 + 1];
+        ++faceBegin[face.v3 + 1];
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        faceBegin[v + 1] += faceBegin[v];
+    }
+    std::vector<uint32_t> vertexFaces(faces.size() * 3);
+    std::vector<uint32_t> faceCount(vertexCount, 0);
+    for (uint32_t t = 0; t < faces.size(); ++t) {
+        for (int v : {faces[t].v1, faces[t].v2, faces[t].v3}) {
+            vertexFaces[faceBegin[v] + faceCount[v]++] = t;
+        }
+    }
+    std::vector<uint32_t> faceCapacity(faceCount);
+    auto hasCorner = [](const Triangle& face, uint32_t v) {
+        int corner = static_cast<int>(v);
+        return face.v1 == corner || face.v2 == corner || face.v3 == corner;
+    };
+
+    auto sharedFaces = [&](int a, int b) {
+        int count = 0;
+        for (uint32_t k = faceBegin[a]; k < faceBegin[a] + faceCount[a]; ++k) {
+            count += hasCorner(faces[vertexFaces[k]], static_cast<uint32_t>(b));
+        }
+        return count;
+    };
+    for (const Triangle& face : faces) {
+        int corners[3] = {face.v1, face.v2, face.v3};
+        for (int k = 0; k < 3; ++k) {
+            int a = corners[k];
+            int b = corners[(k + 1) % 3];
+            if (sharedFaces(a, b) != 1) {
+                continue;
+            }
+            const Vertex& pa = positions[a];
+            const Vertex& pb = positions[b];
+            double n[3];
+            triangleCross(pa, pb, positions[corners[(k + 2) % 3]], n);
+            double edge[3] = {pb.x - pa.x, pb.y - pa.y, pb.z - pa.z};
+            double side[3] = {edge[1] * n[2] - edge[2] * n[1], edge[2] * n[0] - edge[0] * n[2],
+                              edge[0] * n[1] - edge[1] * n[0]};
+            double length = std::sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+            if (length == 0.0) {
+                continue;
+            }
+            double edgeLengthSquared = edge[0] * edge[0] + edge[1] * edge[1] + edge[2] * edge[2];
+            double a0 = side[0] / length;
+            double b0 = side[1] / length;
+            double c0 = side[2] / length;
+            double d0 = -(a0 * pa.x + b0 * pa.y + c0 * pa.z);
+            quadrics[a].addPlane(a0, b0, c0, d0, 10.0 * edgeLengthSquared);
+            quadrics[b].addPlane(a0, b0, c0, d0, 10.0 * edgeLengthSquared);
+        }
+    }
+
+    std::vector<Vertex> current(positions);
+    std::vector<uint32_t> stamps(vertexCount, 0);
+    std::vector<uint8_t> removedVertex(vertexCount, 0);
+    std::vector<uint8_t> removedFace(faces.size(), 0);
+    // Marcas do anel de from no teste de enlace: ringEpoch para vizinhos de
+    // from, ringEpoch + 1 para os ja contados como comuns a to.
+    std::vector<uint32_t> ringMark(vertexCount, 0);
+    uint32_t ringEpoch = 0;
+    std::vector<uint32_t> mergedFaces;
+    std::priority_queue<EdgeCollapse, std::vector<EdgeCollapse>, std::greater<EdgeCollapse>> heap;
+    auto pushEdge = [&](uint32_t a, uint32_t b) {
+        Quadric merged = quadrics[a];
+        merged.add(quadrics[b]);
+        double toB = merged.error(current[b]);
+        double toA = merged.error(current[a]);
+        if (toB <= toA) {
+            heap.push({toB, a, b, stamps[a], stamps[b]});
+        } else {
+            heap.push({toA, b, a, stamps[b], stamps[a]});
+        }
+    };
+    for (const Triangle& face : faces) {
+        pushEdge(face.v1, face.v2);
+        pushEdge(face.v2, face.v3);
+        pushEdge(face.v3, face.v1);
+    }
+
+    size_t liveFaces = faces.size();
+    size_t targetIndex = 0;
+    size_t targetCount = sizeof(lodTargets) / sizeof(lodTargets[0]);
+    double maxError = 0.0;
+    auto snapshot = [&]() {
+        LODLevel level{static_cast<uint32_t>(indices.size()), 0, static_cast<float>(std::sqrt(maxError))};
+        for (size_t t = 0; t < faces.size(); ++t) {
+            if (!removedFace[t]) {
+                indices.push_back(faces[t].v1);
+                indices.push_back(faces[t].v2);
+                indices.push_back(faces[t].v3);
+                ++level.triangleCount;
+            }
+        }
+        levels.push_back(level);
+    };
+
+    while (!heap.empty() && targetIndex < targetCount && !lodCancel.load(std::memory_order_relaxed)) {
+        if (liveFaces <= static_cast<size_t>(lodTargets[targetIndex] * faces.size())) {
+            snapshot();
+            ++targetIndex;
+            continue;
+        }
+        EdgeCollapse collapse = heap.top();
+        heap.pop();
+        uint32_t from = collapse.from;
+        uint32_t to = collapse.to;
+        if (removedVertex[from] || removedVertex[to] || stamps[from] != collapse.fromStamp ||
+            stamps[to] != collapse.toStamp) {
+            continue;
+        }
+
+        // Condicao de enlace: os vizinhos comuns de from e to so podem ser os
+        // vertices opostos a aresta, 2 numa aresta interna e 1 na borda. Um
+        // vizinho comum a mais e o colapso cola duas folhas da superficie.
+        ringEpoch += 2;
+        for (uint32_t k = faceBegin[from]; k < faceBegin[from] + faceCount[from]; ++k) {
+            if (removedFace[vertexFaces[k]]) {
+                continue;
+            }
+            const Triangle& face = faces[vertexFaces[k]];
+            for (int v : {face.v1, face.v2, face.v3}) {
+                ringMark[v] = ringEpoch;
+            }
+        }
+        int edgeFaces = 0;
+        int commonNeighbors = 0;
+        for (uint32_t k = faceBegin[to]; k < faceBegin[to] + faceCount[to]; ++k) {
+            if (removedFace[vertexFaces[k]]) {
+                continue;
+            }
+            const Triangle& face = faces[vertexFaces[k]];
+            edgeFaces += hasCorner(face, from);
+            for (int v : {face.v1, face.v2, face.v3}) {
+                if (ringMark[v] == ringEpoch && v != static_cast<int>(from) && v != static_cast<int>(to)) {
+                    ringMark[v] = ringEpoch + 1;
+                    ++commonNeighbors;
+                }
+            }
+        }
+        if (commonNeighbors > std::min(edgeFaces, 2)) {
+            continue;
+        }
+
+        bool flips = false;
+        for (uint32_t k = faceBegin[from]; k < faceBegin[from] + faceCount[from]; ++k) {
+            const Triangle& face = faces[vertexFaces[k]];
+            if (removedFace[vertexFaces[k]] || hasCorner(face, to)) {
+                continue;
+            }
+            int corners[3] = {face.v1, face.v2, face.v3};
+            Vertex moved[3];
+            for (int k = 0; k < 3; ++k) {
+                moved[k] = current[corners[k] == static_cast<int>(from) ? static_cast<int>(to) : corners[k]];
+            }
+            double before[3];
+            double after[3];
+            triangleCross(current[face.v1], current[face.v2], current[face.v3], before);
+            triangleCross(moved[0], moved[1], moved[2], after);
+            if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0.0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) {
+            continue;
+        }
+
+        maxError = std::max(maxError, collapse.cost);
+        removedVertex[from] = 1;
+        quadrics[to].add(quadrics[from]);
+        mergedFaces.clear();
+        for (uint32_t k = faceBegin[from]; k < faceBegin[from] + faceCount[from]; ++k) {
+            uint32_t t = vertexFaces[k];
+            if (removedFace[t]) {
+                continue;
+            }
+            Triangle& face = faces[t];
+            if (hasCorner(face, to)) {
+                removedFace[t] = 1;
+                --liveFaces;
+                continue;
+            }
+            for (int* corner : {&face.v1, &face.v2, &face.v3}) {
+                if (*corner == static_cast<int>(from)) {
+                    *corner = static_cast<int>(to);
+                }
+            }
+            mergedFaces.push_back(t);
+        }
+        for (uint32_t k = faceBegin[to]; k < faceBegin[to] + faceCount[to]; ++k) {
+            if (!removedFace[vertexFaces[k]]) {
+                mergedFaces.push_back(vertexFaces[k]);
+            }
+        }
+        if (mergedFaces.size() > faceCapacity[to]) {
+            faceBegin[to] = static_cast<uint32_t>(vertexFaces.size());
+            faceCapacity[to] = static_cast<uint32_t>(mergedFaces.size());
+            vertexFaces.insert(vertexFaces.end(), mergedFaces.begin(), mergedFaces.end());
+        } else {
+            std::copy(mergedFaces.begin(), mergedFaces.end(), vertexFaces.begin() + faceBegin[to]);
+        }
+        faceCount[to] = static_cast<uint32_t>(mergedFaces.size());
+        faceCount[from] = 0;
+        ++stamps[to];
+        for (uint32_t t : mergedFaces) {
+            const Triangle& face = faces[t];
+            for (int v : {face.v1, face.v2, face.v3}) {
+                if (v != static_cast<int>(to)) {
+                    pushEdge(to, static_cast<uint32_t>(v));
+                }
+            }
+        }
+    }
+}
+
+// Gera os niveis numa thread propria a partir de uma copia da malha, para nao
+// atrasar a primeira imagem; o render passa a usa-los quando lodReady vira true.
+void startLODBuild() {
+    if (!lodEnabled || triangles.empty()) {
+        return;
+    }
+    lodThread = std::thread([positions = vertices, faces = triangles]() mutable {
+        auto start = std::chrono::steady_clock::now();
+        simplifyMesh(positions, std::move(faces), lodLevels, lodIndices);
+        if (lodCancel.load()) {
+            return;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::ostringstream report;
+        report << "LOD:";
+        for (const LODLevel& level : lodLevels) {
+            report << ' ' << level.triangleCount;
+        }
+        report << " triangles in " << elapsed.count() << " ms\n";
+        std::cout << report.str() << std::flush;
+        lodReady.store(true, std::memory_order_release);
+    });
+}
+
+void stopLODBuild() {
+    lodCancel.store(true);
+    if (lodThread.joinable()) {
+        lodThread.join();
+    }
+}
+
+// Normal do vertice v como a media das normais dos triangulos que o usam.
+inline void gatherVertexNormal(size_t v, float* normal) {
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    for (uint32_t k = vertexTriangleOffsets[v]; k < vertexTriangleOffsets[v + 1]; ++k) {
+        const float* faceNormal = &triangleNormals[vertexTriangles[k] * 3];
+        sum[0] += faceNormal[0];
+        sum[1] += faceNormal[1];
+        sum[2] += faceNormal[2];
+    }
+    float length = std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+    normal[0] = sum[0] / length;
+    normal[1] = sum[1] / length;
+    normal[2] = sum[2] / length;
+}
+
+// Cada vertice soma so os seus triangulos, na ordem da adjacencia, entao os
+// vertices podem ser calculados em paralelo sem atomicos e o resultado nao
+// depende do numero de threads.
+void calculateVertexNormals() {
+    if (!vertexAdjacencyIsCurrent()) {
+        buildVertexAdjacency();
+    }
+    vertexNormals.resize(vertices.size() * 3);
+    parallelFor(vertices.size(), 1 << 14, [](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            gatherVertexNormal(v, &vertexNormals[v * 3]);
+        }
+    });
+}
+
+// Vertices cuja posicao mudou desde a ultima atualizacao de normais.
+std::vector<uint32_t> dirtyVertices;
+// Marcas por vertice e por triangulo usadas para nao repetir elementos nas
+// listas; comparar com a epoca atual evita limpar os arrays a cada atualizacao.
+std::vector<uint32_t> vertexMark;
+std::vector<uint32_t> triangleMark;
+uint32_t markEpoch = 0;
+
+// Registra que vertices[v] mudou. As normais so sao recalculadas em
+// updateDirtyNormals().
+void markVertexDirty(uint32_t v) {
+    dirtyVertices.push_back(v);
+}
+
+void setVertexPosition(uint32_t v, const Vertex& position) {
+    vertices[v] = position;
+    markVertexDirty(v);
+}
+
+// Recalcula so as normais afetadas pelos vertices marcados: as dos triangulos
+// que usam esses vertices e as normais de todos os vertices desses triangulos
+// (o anel de vizinhos). O custo e proporcional a edicao, nao a malha. Se a
+// edicao cobre boa parte da malha, as passadas completas saem mais baratas.
+// Normais vindas do arquivo (authoredNormals) nao sao sobrescritas.
+void updateDirtyNormals() {
+    if (dirtyVertices.empty()) {
+        return;
+    }
+    if (!vertexAdjacencyIsCurrent()) {
+        buildVertexAdjacency();
+    }
+    if (dirtyVertices.size() * 8 > vertices.size()) {
+        calculateFaceNormals();
+        if (!authoredNormals) {
+            calculateVertexNormals();
+        }
+        dirtyVertices.clear();
+        ++geometryVersion;
+        return;
+    }
+
+    if (vertexMark.size() != vertices.size() || triangleMark.size() != triangles.size() || ++markEpoch == 0) {
+        vertexMark.assign(vertices.size(), 0);
+        triangleMark.assign(triangles.size(), 0);
+        markEpoch = 1;
+    }
+    std::vector<uint32_t> dirtyTriangles;
+    for (uint32_t v : dirtyVertices) {
+        for (uint32_t k = vertexTriangleOffsets[v]; k < vertexTriangleOffsets[v + 1]; ++k) {
+            uint32_t t = vertexTriangles[k];
+            if (triangleMark[t] != markEpoch) {
+                triangleMark[t] = markEpoch;
+                dirtyTriangles.push_back(t);
+            }
+        }
+    }
+    for (uint32_t t : dirtyTriangles) {
+        faceNormalsScalar(t, t + 1);
+    }
+
+    if (!authoredNormals) {
+        for (uint32_t t : dirtyTriangles) {
+            const Triangle& face = triangles[t];
+            for (int v : {face.v1, face.v2, face.v3}) {
+                if (vertexMark[v] != markEpoch) {
+                    vertexMark[v] = markEpoch;
+                    gatherVertexNormal(v, &vertexNormals[v * 3]);
+                }
+            }
+        }
+    }
+    dirtyVertices.clear();
+    ++geometryVersion;
+}
+
+// Memoria usada pelas normais e pelos vertices, para comparar layouts.
+void printNormalMemoryReport() {
+    double megabyte = 1024.0 * 1024.0;
+    std::cout << "Normals: " << vertexNormals.capacity() * sizeof(float) / megabyte << " MB for "
+              << vertices.size() << " vertices, " << triangleNormals.capacity() * sizeof(float) / megabyte
+              << " MB for " << triangles.size() << " triangles" << std::endl;
+}
+
+// Mede as duas passadas de normais com o buffer plano e com o layout antigo de
+// um std::vector<float> por vertice, sobre a malha do arquivo.
+bool benchmarkNormals(const char* path) {
+    if (!loadOBJ(path)) {
+        return false;
+    }
+    if (!deindexAttributes()) {
+        return false;
+    }
+    triangulateFaces();
+
+    using clock = std::chrono::steady_clock;
+    const int runs = 5;
+    double scalarFace = 1e30;
+    for (int run = 0; run < runs; ++run) {
+        triangleNormals.resize(triangles.size() * 3);
+        auto start = clock::now();
+        faceNormalsScalar(0, triangles.size());
+        scalarFace = std::min(scalarFace, std::chrono::duration<double, std::milli>(clock::now() - start).count());
+    }
+    auto adjacencyStart = clock::now();
+    buildVertexAdjacency();
+    double adjacency = std::chrono::duration<double, std::milli>(clock::now() - adjacencyStart).count();
+    double flatFace = 1e30, flatVertex = 1e30, nestedVertex = 1e30;
+    for (int run = 0; run < runs; ++run) {
+        auto start = clock::now();
+        calculateFaceNormals();
+        auto middle = clock::now();
+        calculateVertexNormals();
+        auto end = clock::now();
+        flatFace = std::min(flatFace, std::chrono::duration<double, std::milli>(middle - start).count());
+        flatVertex = std::min(flatVertex, std::chrono::duration<double, std::milli>(end - middle).count());
+    }
+    AlignedFloats flat = vertexNormals;
+
+    size_t nestedBytes = 0;
+    for (int run = 0; run < runs; ++run) {
+        auto start = clock::now();
+        std::vector<std::vector<float>> nested(vertices.size(), std::vector<float>(3, 0.0f));
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            const float* normal = &triangleNormals[i * 3];
+            for (int v : {triangles[i].v1, triangles[i].v2, triangles[i].v3}) {
+                nested[v][0] += normal[0];
+                nested[v][1] += normal[1];
+                nested[v][2] += normal[2];
+            }
+        }
+        for (auto& normal : nested) {
+            float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            normal[0] /= length;
+            normal[1] /= length;
+            normal[2] /= length;
+        }
+        nestedVertex = std::min(nestedVertex, std::chrono::duration<double, std::milli>(clock::now() - start).count());
+        // Cada vetor interno custa o proprio objeto mais um bloco de heap (cabecalho de 16 bytes do malloc).
+        nestedBytes = nested.capacity() * sizeof(std::vector<float>) + nested.size() * (3 * sizeof(float) + 16);
+    }
+
+    double megabyte = 1024.0 * 1024.0;
+    std::cout << vertices.size() << " vertices, " << triangles.size() << " triangles" << std::endl;
+    std::cout << "face normals (scalar, 1 thread): " << scalarFace << " ms" << std::endl;
+    std::cout << "face normals (dispatched kernel, " << threadPool().size() << " threads): " << flatFace << " ms"
+              << std::endl;
+    std::cout << "vertex adjacency build: " << adjacency << " ms, "
+              << (vertexTriangleOffsets.size() + vertexTriangles.size()) * sizeof(uint32_t) / megabyte << " MB"
+              << std::endl;
+    std::cout << "vertex normals (adjacency gather): " << flatVertex << " ms, " << flat.size() * sizeof(float) / megabyte << " MB"
+              << std::endl;
+    std::cout << "vertex normals (nested scatter): " << nestedVertex << " ms, ~" << nestedBytes / megabyte << " MB"
+              << std::endl;
+    return true;
+}
+// Cache binario ao lado do .obj (<arquivo>.p3d) com a malha ja processada.
+// Cada secao comeca alinhada em meshCacheAlignment bytes. O cache e invalidado
+// quando o tamanho ou o mtime do arquivo de origem mudam.
+const char meshCacheMagic[8] = {'P', '3', 'D', 'M', 'E', 'S', 'H', '\0'};
+const uint32_t meshCacheVersion = 6;
+const uint64_t meshCacheAlignment = 64;
+
+enum MeshCacheSection {
+    CACHE_POSITIONS,          // float[3 * vertices]
+    CACHE_FACE_OFFSETS,       // uint32[faces + 1]
+    CACHE_FACE_INDICES,       // int32[faceOffsets[faces]]
+    CACHE_TRIANGLES,          // int32[3 * triangles]
+    CACHE_FACE_NORMALS,       // float[3 * triangles]
+    CACHE_VERTEX_NORMALS,     // float[3 * vertices]
+    CACHE_TEXCOORDS,          // float[2 * vertices], vazio sem vt
+    CACHE_TRANSFORM_OFFSETS,  // uint64[transformations + 1]
+    CACHE_TRANSFORM_TEXT,     // char[]
+    CACHE_SECTION_COUNT
+};
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec;
+    int64_t sourceMtimeNsec;
+    float weldEpsilon; // -1 quando a malha nao foi soldada
+    uint32_t authoredNormals; // 1 quando vertexNormals veio dos vn do arquivo
+    struct {
+        uint64_t offset;
+        uint64_t bytes;
+    } sections[CACHE_SECTION_COUNT];
+};
+
+bool useMeshCache = true;
+
+std::string meshCachePath(const char* path) {
+    return std::string(path) + ".p3d";
+}
+
+bool statSource(const char* path, MeshCacheHeader& header) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    header.sourceSize = static_cast<uint64_t>(st.st_size);
+    header.sourceMtimeSec = st.st_mtim.tv_sec;
+    header.sourceMtimeNsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool writeMeshCache(const char* path) {
+    MeshCacheHeader header = {};
+    std::memcpy(header.magic, meshCacheMagic, sizeof(header.magic));
+    header.version = meshCacheVersion;
+    header.sectionCount = CACHE_SECTION_COUNT;
+    header.weldEpsilon = weldEnabled ? weldEpsilon : -1.0f;
+    header.authoredNormals = authoredNormals ? 1 : 0;
+    if (!statSource(path, header)) {
+        return false;
+    }
+
+    std::vector<uint64_t> transformOffsets(1, 0);
+    std::string transformText;
+    for (const auto& transformation : transformations) {
+        transformText += transformation;
+        transformOffsets.push_back(transformText.size());
+    }
+
+    const void* data[CACHE_SECTION_COUNT] = {
+            vertices.data(), faceOffsets.data(), faceIndices.data(), triangles.data(),
+            triangleNormals.data(), vertexNormals.data(), vertexTexcoords.data(), transformOffsets.data(),
+            transformText.data()};
+    uint64_t bytes[CACHE_SECTION_COUNT] = {
+            vertices.size() * sizeof(Vertex), faceOffsets.size() * sizeof(uint32_t),
+            faceIndices.size() * sizeof(int), triangles.size() * sizeof(Triangle),
+            triangleNormals.size() * sizeof(float), vertexNormals.size() * sizeof(float),
+            vertexTexcoords.size() * sizeof(float),
+            transformOffsets.size() * sizeof(uint64_t), transformText.size()};
+    uint64_t offset = sizeof(MeshCacheHeader);
+    for (int i = 0; i < CACHE_SECTION_COUNT; ++i) {
+        offset = (offset + meshCacheAlignment - 1) / meshCacheAlignment * meshCacheAlignment;
+        header.sections[i].offset = offset;
+        header.sections[i].bytes = bytes[i];
+        offset += bytes[i];
+    }
+
+    // Escreve num arquivo temporario e renomeia, para nunca deixar um cache pela metade.
+    std::string cachePath = meshCachePath(path);
+    std::string tempPath = cachePath + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t position = sizeof(header);
+    const char padding[meshCacheAlignment] = {};
+    for (int i = 0; i < CACHE_SECTION_COUNT; ++i) {
+        out.write(padding, static_cast<std::streamsize>(header.sections[i].offset - position));
+        out.write(static_cast<const char*>(data[i]), static_cast<std::streamsize>(bytes[i]));
+        position = header.sections[i].offset + bytes[i];
+    }
+    out.close();
+    if (!out || std::rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Carrega vertices, faces, triangulos, normais e transformacoes do cache, se ele
+// existir e estiver atualizado em relacao ao .obj.
+bool loadMeshCache(const char* path) {
+    MeshCacheHeader source;
+    if (!statSource(path, source)) {
+        return false;
+    }
+    MappedFile file;
+    if (!mapFile(meshCachePath(path).c_str(), file)) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool valid = file.size >= sizeof(MeshCacheHeader);
+    MeshCacheHeader header;
+    if (valid) {
+        std::memcpy(&header, file.data, sizeof(header));
+        valid = std::memcmp(header.magic, meshCacheMagic, sizeof(header.magic)) == 0 &&
+                header.version == meshCacheVersion && header.sectionCount == CACHE_SECTION_COUNT &&
+                header.sourceSize == source.sourceSize && header.sourceMtimeSec == source.sourceMtimeSec &&
+                header.sourceMtimeNsec == source.sourceMtimeNsec &&
+                header.weldEpsilon == (weldEnabled ? weldEpsilon : -1.0f);
+    }
+    for (int i = 0; valid && i < CACHE_SECTION_COUNT; ++i) {
+        valid = header.sections[i].offset % meshCacheAlignment == 0 && header.sections[i].offset <= file.size &&
+                header.sections[i].bytes <= file.size - header.sections[i].offset;
+    }
+    uint64_t vertexCount = valid ? header.sections[CACHE_POSITIONS].bytes / sizeof(Vertex) : 0;
+    uint64_t offsetCount = valid ? header.sections[CACHE_FACE_OFFSETS].bytes / sizeof(uint32_t) : 0;
+    uint64_t indexCount = valid ? header.sections[CACHE_FACE_INDICES].bytes / sizeof(int32_t) : 0;
+    uint64_t triangleCount = valid ? header.sections[CACHE_TRIANGLES].bytes / sizeof(Triangle) : 0;
+    uint64_t transformCount = valid ? header.sections[CACHE_TRANSFORM_OFFSETS].bytes / sizeof(uint64_t) : 0;
+    valid = valid && header.sections[CACHE_POSITIONS].bytes == vertexCount * sizeof(Vertex) &&
+            header.sections[CACHE_FACE_OFFSETS].bytes == offsetCount * sizeof(uint32_t) &&
+            header.sections[CACHE_FACE_INDICES].bytes == indexCount * sizeof(int32_t) &&
+            header.sections[CACHE_TRIANGLES].bytes == triangleCount * sizeof(Triangle) &&
+            header.sections[CACHE_FACE_NORMALS].bytes == triangleCount * 3 * sizeof(float) &&
+            header.sections[CACHE_VERTEX_NORMALS].bytes == vertexCount * 3 * sizeof(float) &&
+            (header.sections[CACHE_TEXCOORDS].bytes == 0 ||
+             header.sections[CACHE_TEXCOORDS].bytes == vertexCount * 2 * sizeof(float)) &&
+            offsetCount > 0 && transformCount > 0;
+    if (!valid) {
+        unmapFile(file);
+        return false;
+    }
+
+    auto section = [&](MeshCacheSection type) { return file.data + header.sections[type].offset; };
+    const auto* offsets = reinterpret_cast<const uint32_t*>(section(CACHE_FACE_OFFSETS));
+    const auto* indices = reinterpret_cast<const int32_t*>(section(CACHE_FACE_INDICES));
+    const auto* cachedTriangles = reinterpret_cast<const int32_t*>(section(CACHE_TRIANGLES));
+    const auto* normals = reinterpret_cast<const float*>(section(CACHE_VERTEX_NORMALS));
+    const auto* transformOffsets = reinterpret_cast<const uint64_t*>(section(CACHE_TRANSFORM_OFFSETS));
+    const char* transformText = section(CACHE_TRANSFORM_TEXT);
+
+    for (uint64_t i = 0; i + 1 < transformCount; ++i) {
+        if (transformOffsets[i] > transformOffsets[i + 1] ||
+            transformOffsets[i + 1] > header.sections[CACHE_TRANSFORM_TEXT].bytes) {
+            unmapFile(file);
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i + 1 < offsetCount; ++i) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > indexCount) {
+            unmapFile(file);
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < indexCount; ++i) {
+        if (indices[i] < 0 || static_cast<uint64_t>(indices[i]) >= vertexCount) {
+            unmapFile(file);
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < triangleCount * 3; ++i) {
+        if (cachedTriangles[i] < 0 || static_cast<uint64_t>(cachedTriangles[i]) >= vertexCount) {
+            unmapFile(file);
+            return false;
+        }
+    }
+
+    vertices.resize(vertexCount);
+    std::memcpy(vertices.data(), section(CACHE_POSITIONS), vertexCount * sizeof(Vertex));
+    faceOffsets.assign(offsets, offsets + offsetCount);
+    faceIndices.assign(indices, indices + indexCount);
+    triangles.resize(triangleCount);
+    std::memcpy(triangles.data(), cachedTriangles, triangleCount * sizeof(Triangle));
+    triangleNormals.resize(triangleCount * 3);
+    std::memcpy(triangleNormals.data(), section(CACHE_FACE_NORMALS), triangleCount * 3 * sizeof(float));
+    vertexNormals.assign(normals, normals + vertexCount * 3);
+    const auto* texcoords = reinterpret_cast<const float*>(section(CACHE_TEXCOORDS));
+    vertexTexcoords.assign(texcoords, texcoords + header.sections[CACHE_TEXCOORDS].bytes / sizeof(float));
+    transformations.clear();
+    for (uint64_t i = 0; i + 1 < transformCount; ++i) {
+        transformations.emplace_back(transformText + transformOffsets[i], transformText + transformOffsets[i + 1]);
+    }
+    authoredNormals = header.authoredNormals != 0;
+    unmapFile(file);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Loaded " << meshCachePath(path) << ": " << vertices.size() << " vertices, "
+              << faceOffsets.size() - 1 << " faces in " << elapsed.count() * 1000.0 << " ms" << std::endl;
+    return true;
+}
+
+// Carrega a malha e suas normais, usando o cache binario quando possivel. As
+// estruturas que dependem da malha inteira ficam para buildMeshStructures().
+bool loadMeshGeometry(const char* path) {
+    if (useMeshCache && loadMeshCache(path)) {
+        return true;
+    }
+    if (!loadOBJ(path)) {
+        return false;
+    }
+    if (weldEnabled) {
+        weldVertices(weldEpsilon);
+    }
+    if (!deindexAttributes()) {
+        return false;
+    }
+    triangulateFaces();
+    optimizeMeshOrder();
+    buildVertexAdjacency();
+    calculateFaceNormals();
+    if (!authoredNormals) {
+        calculateVertexNormals();
+    }
+    if (useMeshCache && !writeMeshCache(path)) {
+        std::cerr << "Failed to write mesh cache: " << meshCachePath(path) << std::endl;
+    }
+    return true;
+}
+
+void buildMeshStructures() {
+    if (!vertexAdjacencyIsCurrent()) {
+        buildVertexAdjacency();
+    }
+    buildMeshEdges();
+    buildBVH();
+    buildMeshClusters();
+}
+
+bool loadMesh(const char* path) {
+    if (!loadMeshGeometry(path)) {
+        return false;
+    }
+    buildMeshStructures();
+    return true;
+}
+
+// Motor de transformacao de vertices. Os buffers sao arrays de xyz
+// intercalados (Vertex ou normais); os kernels SIMD separam 8 (AVX2) ou 4
+// (NEON) vetores em registradores x/y/z, aplicam a matriz e intercalam de volta.
+
+// Parte linear (3x3) e translacao de uma matriz afim, em ordem de linha.
+struct AffineTransform {
+    float m[9];
+    float t[3];
+};
+
+AffineTransform affineFromMatrix(const Matrix4& matrix) {
+    const GLfloat* a = matrix.m;
+    return {{a[0], a[4], a[8], a[1], a[5], a[9], a[2], a[6], a[10]}, {a[12], a[13], a[14]}};
+}
+
+// Inversa transposta da parte linear, usada para normais. Sem translacao.
+AffineTransform normalTransformFromMatrix(const Matrix4& matrix) {
+    AffineTransform a = affineFromMatrix(matrix);
+    const float* m = a.m;
+    float cofactor[9] = {
+            m[4] * m[8] - m[5] * m[7], m[5] * m[6] - m[3] * m[8], m[3] * m[7] - m[4] * m[6],
+            m[2] * m[7] - m[1] * m[8], m[0] * m[8] - m[2] * m[6], m[1] * m[6] - m[0] * m[7],
+            m[1] * m[5] - m[2] * m[4], m[2] * m[3] - m[0] * m[5], m[0] * m[4] - m[1] * m[3]};
+    float determinant = m[0] * cofactor[0] + m[1] * cofactor[1] + m[2] * cofactor[2];
+    AffineTransform result = {};
+    for (int i = 0; i < 9; ++i) {
+        result.m[i] = cofactor[i] / determinant;
+    }
+    return result;
+}
+
+void transformVectorsScalar(float* xyz, size_t begin, size_t end, const AffineTransform& a, bool normalize) {
+    const float* m = a.m;
+    for (size_t i = begin; i < end; ++i) {
+        float* p = xyz + i * 3;
+        float x = m[0] * p[0] + m[1] * p[1] + m[2] * p[2] + a.t[0];
+        float y = m[3] * p[0] + m[4] * p[1] + m[5] * p[2] + a.t[1];
+        float z = m[6] * p[0] + m[7] * p[1] + m[8] * p[2] + a.t[2];
+        if (normalize) {
+            float length = std::sqrt(x * x + y * y + z * z);
+            x /= length;
+            y /= length;
+            z /= length;
+        }
+        p[0] = x;
+        p[1] = y;
+        p[2] = z;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) void transformVectorsAVX2(float* xyz, size_t begin, size_t end,
+                                                               const AffineTransform& a, bool normalize) {
+    __m256 m[9];
+    for (int k = 0; k < 9; ++k) {
+        m[k] = _mm256_set1_ps(a.m[k]);
+    }
+    const __m256 tx = _mm256_set1_ps(a.t[0]);
+    const __m256 ty = _mm256_set1_ps(a.t[1]);
+    const __m256 tz = _mm256_set1_ps(a.t[2]);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        float* p = xyz + i * 3;
+        // 8 xyz intercalados -> registradores x, y, z.
+        __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+        __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+        __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+        __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+        __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+        __m256 x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+        __m256 y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+
+        __m256 rx = _mm256_fmadd_ps(m[0], x, _mm256_fmadd_ps(m[1], y, _mm256_fmadd_ps(m[2], z, tx)));
+        __m256 ry = _mm256_fmadd_ps(m[3], x, _mm256_fmadd_ps(m[4], y, _mm256_fmadd_ps(m[5], z, ty)));
+        __m256 rz = _mm256_fmadd_ps(m[6], x, _mm256_fmadd_ps(m[7], y, _mm256_fmadd_ps(m[8], z, tz)));
+        if (normalize) {
+            __m256 lengthSquared = _mm256_fmadd_ps(rx, rx, _mm256_fmadd_ps(ry, ry, _mm256_mul_ps(rz, rz)));
+            __m256 r = _mm256_rsqrt_ps(lengthSquared);
+            r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, lengthSquared), _mm256_mul_ps(r, r),
+                                                  threeHalves));
+            rx = _mm256_mul_ps(rx, r);
+            ry = _mm256_mul_ps(ry, r);
+            rz = _mm256_mul_ps(rz, r);
+        }
+
+        // Registradores x, y, z -> 8 xyz intercalados.
+        __m256 rxy = _mm256_shuffle_ps(rx, ry, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 ryz = _mm256_shuffle_ps(ry, rz, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 rzx = _mm256_shuffle_ps(rz, rx, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 r03 = _mm256_shuffle_ps(rxy, rzx, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 r14 = _mm256_shuffle_ps(ryz, rxy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 r25 = _mm256_shuffle_ps(rzx, ryz, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(p, _mm256_castps256_ps128(r03));
+        _mm_storeu_ps(p + 4, _mm256_castps256_ps128(r14));
+        _mm_storeu_ps(p + 8, _mm256_castps256_ps128(r25));
+        _mm_storeu_ps(p + 12, _mm256_extractf128_ps(r03, 1));
+        _mm_storeu_ps(p + 16, _mm256_extractf128_ps(r14, 1));
+        _mm_storeu_ps(p + 20, _mm256_extractf128_ps(r25, 1));
+    }
+    transformVectorsScalar(xyz, i, end, a, normalize);
+}
+#endif
+
+#if defined(__aarch64__)
+void transformVectorsNEON(float* xyz, size_t begin, size_t end, const AffineTransform& a, bool normalize) {
+    const float* m = a.m;
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        float* p = xyz + i * 3;
+        float32x4x3_t v = vld3q_f32(p);
+        float32x4x3_t r;
+        for (int row = 0; row < 3; ++row) {
+            float32x4_t sum = vdupq_n_f32(a.t[row]);
+            sum = vfmaq_n_f32(sum, v.val[0], m[row * 3]);
+            sum = vfmaq_n_f32(sum, v.val[1], m[row * 3 + 1]);
+            r.val[row] = vfmaq_n_f32(sum, v.val[2], m[row * 3 + 2]);
+        }
+        if (normalize) {
+            float32x4_t lengthSquared = vfmaq_f32(
+                    vfmaq_f32(vmulq_f32(r.val[2], r.val[2]), r.val[1], r.val[1]), r.val[0], r.val[0]);
+            float32x4_t s = vrsqrteq_f32(lengthSquared);
+            s = vmulq_f32(s, vrsqrtsq_f32(vmulq_f32(lengthSquared, s), s));
+            for (auto& component : r.val) {
+                component = vmulq_f32(component, s);
+            }
+        }
+        vst3q_f32(p, r);
+    }
+    transformVectorsScalar(xyz, i, end, a, normalize);
+}
+#endif
+
+using TransformKernel = void (*)(float*, size_t, size_t, const AffineTransform&, bool);
+
+TransformKernel transformKernel() {
+    if (!simdEnabled) {
+        return transformVectorsScalar;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return transformVectorsAVX2;
+    }
+#elif defined(__aarch64__)
+    return transformVectorsNEON;
+#endif
+    return transformVectorsScalar;
+}
+
+// Aplica a transformacao a count vetores xyz em blocos paralelos. Com
+// normalize, cada resultado e normalizado (para normais).
+void transformVectors(float* xyz, size_t count, const AffineTransform& transform, bool normalize) {
+    TransformKernel kernel = transformKernel();
+    parallelFor(count, 1 << 16, [&](size_t begin, size_t end) {
+        kernel(xyz, begin, end, transform, normalize);
+    });
+}
+
+// Aplica matrix a todos os vertices da malha. Com transformNormals, as normais
+// dos triangulos recebem a inversa transposta e sao renormalizadas, sem refazer
+// os produtos vetoriais. As normais de vertice vindas do arquivo sao tratadas
+// do mesmo jeito; as calculadas sao refeitas pela media, ja que a media das
+// normais transformadas nao e a transformada da media.
+void bakeTransform(const Matrix4& matrix, bool transformNormals) {
+    transformVectors(&vertices[0].x, vertices.size(), affineFromMatrix(matrix), false);
+    if (transformNormals) {
+        AffineTransform normalTransform = normalTransformFromMatrix(matrix);
+        transformVectors(triangleNormals.data(), triangleNormals.size() / 3, normalTransform, true);
+        if (authoredNormals) {
+            transformVectors(vertexNormals.data(), vertexNormals.size() / 3, normalTransform, true);
+        } else {
+            calculateVertexNormals();
+        }
+    }
+    ++geometryVersion;
+}
+
+// Uma escala uniforme nao muda a direcao das normais, entao so as posicoes
+// passam pelo motor de transformacao.
+void scaleModel(float scaleFactor) {
+    Matrix4 scale = identityMatrix();
+    scale.m[0] = scaleFactor;
+    scale.m[5] = scaleFactor;
+    scale.m[10] = scaleFactor;
+    bakeTransform(scale, false);
+}
+
+void drawModelWireframe() {
+    glBegin(GL_LINES);
+    for (const auto& face : triangles) {
+        const Vertex& v1 = vertices[face.v1];
+        const Vertex& v2 = vertices[face.v2];
+        const Vertex& v3 = vertices[face.v3];
+
+        glVertex3f(v1.x, v1.y, v1.z);
+        glVertex3f(v2.x, v2.y, v2.z);
+
+        glVertex3f(v2.x, v2.y, v2.z);
+        glVertex3f(v3.x, v3.y, v3.z);
+
+        glVertex3f(v3.x, v3.y, v3.z);
+        glVertex3f(v1.x, v1.y, v1.z);
+    }
+    glEnd();
+}
+
+void drawModelFilled() {
+    glBegin(GL_TRIANGLES);
+    for (const auto& face : triangles) {
+        const Vertex& v1 = vertices[face.v1];
+        const Vertex& v2 = vertices[face.v2];
+        const Vertex& v3 = vertices[face.v3];
+
+        const float* n1 = &vertexNormals[face.v1 * 3];
+        const float* n2 = &vertexNormals[face.v2 * 3];
+        const float* n3 = &vertexNormals[face.v3 * 3];
+
+
+        glNormal3f(n1[0], n1[1], n1[2]);
+        glVertex3f(v1.x, v1.y, v1.z);
+        glNormal3f(n2[0], n2[1], n2[2]);
+        glVertex3f(v2.x, v2.y, v2.z);
+        glNormal3f(n3[0], n3[1], n3[2]);
+        glVertex3f(v3.x, v3.y, v3.z);
+    }
+    glEnd();
+
+    glColor3f(0.0f, 0.0f, 0.0f); // Preto para as arestas
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glBegin(GL_TRIANGLES);
+    for (const auto& face : triangles) {
+        const Vertex& v1 = vertices[face.v1];
+        const Vertex& v2 = vertices[face.v2];
+        const Vertex& v3 = vertices[face.v3];
+
+
+        const float* n1 = &vertexNormals[face.v1 * 3];
+        const float* n2 = &vertexNormals[face.v2 * 3];
+        const float* n3 = &vertexNormals[face.v3 * 3];
+
+        glNormal3f(n1[0], n1[1], n1[2]);
+        glVertex3f(v1.x, v1.y, v1.z);
+        glNormal3f(n2[0], n2[1], n2[2]);
+        glVertex3f(v2.x, v2.y, v2.z);
+        glNormal3f(n3[0], n3[1], n3[2]);
+        glVertex3f(v3.x, v3.y, v3.z);
+    }
+    glEnd();
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
+// Todos os estados exibidos compartilham a mesma malha (vertices/triangles);
+// cada um guarda so a sua matriz e a sua cor. normalMatrix (inversa
+// transposta da parte 3x3, por coluna) so e preenchida para o instanceBuffer,
+// por setNormalMatrix().
+struct ModelView {
+    Matrix4 transform;
+    GLfloat color[4];
+    GLfloat normalMatrix[9] = {};
+};
+
+void setNormalMatrix(ModelView& view) {
+    AffineTransform normal = normalTransformFromMatrix(view.transform);
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) {
+            view.normalMatrix[column * 3 + row] = normal.m[row * 3 + column];
+        }
+    }
+}
+
+// Formato compacto da malha na GPU (--quantize): posicao em 3 x 16 bits sobre
+// a caixa da malha, mais 16 de preenchimento para alinhar o vertice em 8
+// bytes, e normal octaedrica em 2 x 16 bits, 12 bytes por vertice em vez de
+// 24. O vertex shader desfaz a quantizacao. A malha na CPU fica em float, ja
+// que bake, normais e BVH trabalham sobre ela.
+struct QuantizedVertices {
+    std::vector<uint16_t> positions;
+    std::vector<int16_t> normals;
+    float offset[3];
+    float scale[3];
+};
+
+// Pedido na linha de comando; quantizedRendering so liga com os shaders.
+bool quantizeEnabled = false;
+bool quantizedRendering = false;
+
+void encodeOctahedral(const float* normal, int16_t* encoded) {
+    float length = std::fabs(normal[0]) + std::fabs(normal[1]) + std::fabs(normal[2]);
+    float x = length > 0.0f ? normal[0] / length : 0.0f;
+    float y = length > 0.0f ? normal[1] / length : 0.0f;
+    if (normal[2] < 0.0f) {
+        float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    encoded[0] = static_cast<int16_t>(std::lround(std::clamp(x, -1.0f, 1.0f) * 32767.0f));
+    encoded[1] = static_cast<int16_t>(std::lround(std::clamp(y, -1.0f, 1.0f) * 32767.0f));
+}
+
+// Mesma conta do vertex shader, usada para medir o erro.
+void decodeOctahedral(const int16_t* encoded, float* normal) {
+    float x = std::max(encoded[0] / 32767.0f, -1.0f);
+    float y = std::max(encoded[1] / 32767.0f, -1.0f);
+    float z = 1.0f - std::fabs(x) - std::fabs(y);
+    if (z < 0.0f) {
+        float unfoldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float unfoldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = unfoldedX;
+        y = unfoldedY;
+    }
+    float length = std::sqrt(x * x + y * y + z * z);
+    normal[0] = x / length;
+    normal[1] = y / length;
+    normal[2] = z / length;
+}
+
+QuantizedVertices quantizeVertices() {
+    QuantizedVertices quantized;
+    size_t vertexCount = vertices.size();
+    float boundsMin[3] = {0.0f, 0.0f, 0.0f};
+    float boundsMax[3] = {0.0f, 0.0f, 0.0f};
+    for (size_t v = 0; v < vertexCount; ++v) {
+        const float* position = &vertices[v].x;
+        for (int axis = 0; axis < 3; ++axis) {
+            boundsMin[axis] = v == 0 ? position[axis] : std::min(boundsMin[axis], position[axis]);
+            boundsMax[axis] = v == 0 ? position[axis] : std::max(boundsMax[axis], position[axis]);
+        }
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+        quantized.offset[axis] = boundsMin[axis];
+        quantized.scale[axis] = boundsMax[axis] - boundsMin[axis];
+    }
+    quantized.positions.resize(vertexCount * 4);
+    quantized.normals.resize(vertexCount * 2);
+    bool hasNormals = vertexNormals.size() == vertexCount * 3;
+    parallelFor(vertexCount, 16384, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            const float* position = &vertices[v].x;
+            for (int axis = 0; axis < 3; ++axis) {
+                float scale = quantized.scale[axis];
+                float unit = scale > 0.0f ? (position[axis] - quantized.offset[axis]) / scale : 0.0f;
+                quantized.positions[v * 4 + axis] = static_cast<uint16_t>(std::lround(unit * 65535.0f));
+            }
+            quantized.positions[v * 4 + 3] = 0;
+            const float up[3] = {0.0f, 0.0f, 1.0f};
+            encodeOctahedral(hasNormals ? &vertexNormals[v * 3] : up, &quantized.normals[v * 2]);
+        }
+    });
+    return quantized;
+}
+
+// Compara a malha quantizada com a original e estima a memoria na GPU dos dois
+// formatos, contando posicoes, normais, triangulos e arestas.
+void printQuantizationReport() {
+    QuantizedVertices quantized = quantizeVertices();
+    bool hasNormals = vertexNormals.size() == vertices.size() * 3;
+    float positionError = 0.0f;
+    float normalError = 1.0f;
+    for (size_t v = 0; v < vertices.size(); ++v) {
+        const float* position = &vertices[v].x;
+        for (int axis = 0; axis < 3; ++axis) {
+            float restored = quantized.offset[axis] + quantized.scale[axis] * (quantized.positions[v * 4 + axis] / 65535.0f);
+            positionError = std::max(positionError, std::fabs(restored - position[axis]));
+        }
+        if (hasNormals) {
+            const float* normal = &vertexNormals[v * 3];
+            float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            if (length > 0.0f) {
+                float restored[3];
+                decodeOctahedral(&quantized.normals[v * 2], restored);
+                float cosine = (restored[0] * normal[0] + restored[1] * normal[1] + restored[2] * normal[2]) / length;
+                normalError = std::min(normalError, cosine);
+            }
+        }
+    }
+    float diagonal = std::sqrt(quantized.scale[0] * quantized.scale[0] + quantized.scale[1] * quantized.scale[1] +
+                               quantized.scale[2] * quantized.scale[2]);
+    size_t indexCount = triangles.size() * 3 + edgeIndices.size();
+    size_t indexSize = vertices.size() <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+    double megabyte = 1024.0 * 1024.0;
+    double floatBytes = vertices.size() * 6.0 * sizeof(float) + indexCount * sizeof(uint32_t);
+    double quantizedBytes = vertices.size() * 6.0 * sizeof(uint16_t) + static_cast<double>(indexCount) * indexSize;
+    std::cout << "Quantized mesh: " << quantizedBytes / megabyte << " MB instead of " << floatBytes / megabyte
+              << " MB, max position error " << positionError << " (" << (diagonal > 0.0f ? positionError / diagonal : 0.0f)
+              << " of the diagonal), max normal error "
+              << std::acos(std::clamp(normalError, -1.0f, 1.0f)) * 180.0f / 3.14159265f << " degrees" << std::endl;
+}
+
+// Malha na GPU: posicoes e normais em VBOs, triangulos num buffer de indices
+// (na ordem dos clusters), tudo amarrado num VAO; um segundo VAO liga as
+// mesmas posicoes as arestas unicas, desenhadas com GL_LINES no wireframe e no
+// contorno, e um terceiro aos indices dos niveis de detalhe. Enviada uma vez e
+// reenviada so quando geometryVersion muda. --immediate desliga o caminho e
+// volta ao glBegin/glEnd, para comparar. Com --quantize os indices vao em 16
+// bits quando ha ate 65536 vertices, e indexType/indexSize dizem qual.
+struct MeshBuffers {
+    GLuint vertexArray = 0;
+    GLuint positionBuffer = 0;
+    GLuint normalBuffer = 0;
+    GLuint indexBuffer = 0;
+    GLsizei indexCount = 0;
+    GLuint edgeArray = 0;
+    GLuint edgeBuffer = 0;
+    GLsizei edgeIndexCount = 0;
+    GLuint lodArray = 0;
+    GLuint lodBuffer = 0;
+    bool lodUploaded = false;
+    GLenum indexType = GL_UNSIGNED_INT;
+    size_t indexSize = sizeof(uint32_t);
+    float positionOffset[3] = {0.0f, 0.0f, 0.0f};
+    float positionScale[3] = {1.0f, 1.0f, 1.0f};
+    uint64_t version = 0;
+};
+
+MeshBuffers meshBuffers;
+bool bufferedRendering = true;
+
+// Num contexto EGL (--headless) o GLEW compilado para GLX carrega as funcoes
+// do GL e so depois falha por nao achar um display GLX. Chamada uma vez por
+// contexto, antes de initMeshBuffers().
+bool initGLEW() {
+    glewExperimental = GL_TRUE;
+    GLenum status = glewInit();
+    return (status == GLEW_OK || status == GLEW_ERROR_NO_GLX_DISPLAY) && GLEW_VERSION_3_0;
+}
+
+void initMeshBuffers() {
+    glGenVertexArrays(1, &meshBuffers.vertexArray);
+    glGenBuffers(1, &meshBuffers.positionBuffer);
+    glGenBuffers(1, &meshBuffers.normalBuffer);
+    glGenBuffers(1, &meshBuffers.indexBuffer);
+    glGenVertexArrays(1, &meshBuffers.edgeArray);
+    glGenBuffers(1, &meshBuffers.edgeBuffer);
+    glGenVertexArrays(1, &meshBuffers.lodArray);
+    glGenBuffers(1, &meshBuffers.lodBuffer);
+
+    glBindVertexArray(meshBuffers.vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.normalBuffer);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, 3 * sizeof(float), nullptr);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers.indexBuffer);
+
+    glBindVertexArray(meshBuffers.edgeArray);
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), nullptr);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers.edgeBuffer);
+
+    glBindVertexArray(meshBuffers.lodArray);
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.normalBuffer);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, 3 * sizeof(float), nullptr);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers.lodBuffer);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Envia indices ao buffer de elementos do VAO ligado, no tipo de meshBuffers.
+void uploadIndices(const uint32_t* indices, size_t count) {
+    if (meshBuffers.indexType == GL_UNSIGNED_SHORT) {
+        std::vector<uint16_t> compact(indices, indices + count);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, compact.size() * sizeof(uint16_t), compact.data(), GL_STATIC_DRAW);
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+    }
+}
+
+void uploadMeshBuffers() {
+    if (meshBuffers.version == geometryVersion) {
+        return;
+    }
+    if (quantizedRendering) {
+        QuantizedVertices quantized = quantizeVertices();
+        std::copy(quantized.offset, quantized.offset + 3, meshBuffers.positionOffset);
+        std::copy(quantized.scale, quantized.scale + 3, meshBuffers.positionScale);
+        glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+        glBufferData(GL_ARRAY_BUFFER, quantized.positions.size() * sizeof(uint16_t), quantized.positions.data(),
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.normalBuffer);
+        glBufferData(GL_ARRAY_BUFFER, quantized.normals.size() * sizeof(int16_t), quantized.normals.data(),
+                     GL_STATIC_DRAW);
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.normalBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertexNormals.size() * sizeof(float), vertexNormals.data(), GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bool shortIndices = quantizeEnabled && vertices.size() <= 65536;
+    meshBuffers.indexType = shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    meshBuffers.indexSize = shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    glBindVertexArray(meshBuffers.vertexArray);
+    if (drawTriangleOrder.size() == triangles.size()) {
+        std::vector<Triangle> clustered(triangles.size());
+        for (size_t k = 0; k < clustered.size(); ++k) {
+            clustered[k] = triangles[drawTriangleOrder[k]];
+        }
+        uploadIndices(reinterpret_cast<const uint32_t*>(clustered.data()), clustered.size() * 3);
+    } else {
+        uploadIndices(reinterpret_cast<const uint32_t*>(triangles.data()), triangles.size() * 3);
+    }
+    glBindVertexArray(meshBuffers.edgeArray);
+    uploadIndices(edgeIndices.data(), edgeIndices.size());
+    glBindVertexArray(0);
+    meshBuffers.indexCount = static_cast<GLsizei>(triangles.size() * 3);
+    meshBuffers.edgeIndexCount = static_cast<GLsizei>(edgeIndices.size());
+    meshBuffers.version = geometryVersion;
+    traceEvent(TRACE_DEBUG, TRACE_UPLOAD, -1, static_cast<float>(vertices.size()),
+               static_cast<float>(triangles.size()));
+}
+
+// Os niveis chegam da thread de simplificacao; sao enviados uma vez so, ja que
+// indices nao mudam quando a malha e transformada.
+void uploadLODBuffers() {
+    if (meshBuffers.lodUploaded || !lodReady.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (lodThread.joinable()) {
+        lodThread.join();
+    }
+    glBindVertexArray(meshBuffers.lodArray);
+    uploadIndices(lodIndices.data(), lodIndices.size());
+    glBindVertexArray(0);
+    meshBuffers.lodUploaded = true;
+}
+
+// Faixas do buffer de indices a desenhar depois do culling; clusters
+// visiveis vizinhos viram uma faixa so.
+struct DrawRanges {
+    std::vector<GLsizei> counts;
+    std::vector<const void*> offsets;
+};
+
+struct CullStats {
+    size_t clusters = 0;
+    size_t visibleClusters = 0;
+    size_t triangles = 0;
+    size_t submittedTriangles = 0;
+};
+
+// false desenha a malha inteira sempre (--no-cull).
+bool cullingEnabled = true;
+// Somado a cada desenho e zerado a cada frame.
+CullStats cullStats;
+std::vector<uint8_t> clusterVisible;
+
+// Testa os clusters contra o frustum de cada vista (a camera atual vezes a
+// matriz da vista) e devolve as faixas visiveis em pelo menos uma delas, no
+// buffer de triangulos ou no de arestas.
+const DrawRanges& visibleRanges(const ModelView* views, size_t viewCount, bool edges) {
+    static DrawRanges ranges;
+    ranges.counts.clear();
+    ranges.offsets.clear();
+    if (!cullingEnabled || meshClusters.empty()) {
+        ranges.counts.push_back(edges ? meshBuffers.edgeIndexCount : meshBuffers.indexCount);
+        ranges.offsets.push_back(nullptr);
+        cullStats.triangles += triangles.size();
+        cullStats.submittedTriangles += triangles.size();
+        return ranges;
+    }
+    updateClusterBounds();
+    Matrix4 projection;
+    Matrix4 modelView;
+    glGetFloatv(GL_PROJECTION_MATRIX, projection.m);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelView.m);
+    Matrix4 camera = multiplyMatrix(projection, modelView);
+    clusterVisible.assign(meshClusters.size(), 0);
+    CullKernel kernel = cullKernel();
+    for (size_t i = 0; i < viewCount; ++i) {
+        float planes[6][4];
+        extractFrustumPlanes(multiplyMatrix(camera, views[i].transform), planes);
+        kernel(planes, 0, meshClusters.size(), clusterVisible.data());
+    }
+
+    size_t rangeEnd = 0;
+    for (size_t c = 0; c < meshClusters.size(); ++c) {
+        if (!clusterVisible[c]) {
+            continue;
+        }
+        const MeshCluster& cluster = meshClusters[c];
+        size_t first = edges ? cluster.firstEdge * 2 : cluster.firstTriangle * 3;
+        size_t count = edges ? cluster.edgeCount * 2 : cluster.triangleCount * 3;
+        if (!ranges.counts.empty() && rangeEnd == first) {
+            ranges.counts.back() += static_cast<GLsizei>(count);
+        } else {
+            ranges.counts.push_back(static_cast<GLsizei>(count));
+            ranges.offsets.push_back(reinterpret_cast<const void*>(first * meshBuffers.indexSize));
+        }
+        rangeEnd = first + count;
+        ++cullStats.visibleClusters;
+        cullStats.submittedTriangles += cluster.triangleCount;
+    }
+    cullStats.clusters += meshClusters.size();
+    cullStats.triangles += triangles.size();
+    return ranges;
+}
 
-    for (const auto& face : faces) {
-        vertexNormals[face.v1][0] += face.normal[0];
-        vertexNormals[face.v1][1] += face.normal[1];
-        vertexNormals[face.v1][2] += face.normal[2];
+// Vista identidade para os desenhos em que a matriz ja esta na pilha do GL.
+const ModelView stackView = {identityMatrix(), {1.0f, 1.0f, 1.0f, 1.0f}};
 
-        vertexNormals[face.v2][0] += face.normal[0];
-        vertexNormals[face.v2][1] += face.normal[1];
-        vertexNormals[face.v2][2] += face.normal[2];
+// Triangulos por pixel da area projetada a partir dos quais um nivel mais
+// grosso basta.
+const float lodPixelsPerTriangle = 4.0f;
 
-        vertexNormals[face.v3][0] += face.normal[0];
-        vertexNormals[face.v3][1] += face.normal[1];
-        vertexNormals[face.v3][2] += face.normal[2];
+// Escolhe o nivel pela maior area projetada entre as vistas: a esfera que
+// envolve a malha e projetada com a camera atual, e fica o nivel mais fino
+// com no maximo um triangulo a cada lodPixelsPerTriangle pixels. -1 e a
+// malha completa.
+int selectLOD(const ModelView* views, size_t viewCount) {
+    if (!meshBuffers.lodUploaded || lodLevels.empty() || bvhNodes.empty()) {
+        return -1;
+    }
+    updateBVH();
+    const BVHNode& root = bvhNodes[0];
+    float center[3];
+    float radius = 0.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        center[axis] = 0.5f * (root.boundsMin[axis] + root.boundsMax[axis]);
+        float half = 0.5f * (root.boundsMax[axis] - root.boundsMin[axis]);
+        radius += half * half;
+    }
+    radius = std::sqrt(radius);
+    Matrix4 projection;
+    Matrix4 modelView;
+    GLint viewport[4];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection.m);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelView.m);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    float largestArea = 0.0f;
+    for (size_t i = 0; i < viewCount; ++i) {
+        Matrix4 eye = multiplyMatrix(modelView, views[i].transform);
+        const GLfloat* m = eye.m;
+        float depth = -(m[2] * center[0] + m[6] * center[1] + m[10] * center[2] + m[14]);
+        float scale = 0.0f;
+        for (int column = 0; column < 3; ++column) {
+            const GLfloat* c = m + column * 4;
+            scale = std::max(scale, std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]));
+        }
+        float eyeRadius = radius * scale;
+        if (depth <= eyeRadius) {
+            return -1;
+        }
+        float pixels = eyeRadius * projection.m[5] * 0.5f * static_cast<float>(viewport[3]) / depth;
+        largestArea = std::max(largestArea, 3.14159265f * pixels * pixels);
+    }
+    size_t budget = static_cast<size_t>(largestArea / lodPixelsPerTriangle);
+    if (triangles.size() <= budget) {
+        return -1;
+    }
+    for (size_t level = 0; level < lodLevels.size(); ++level) {
+        if (lodLevels[level].triangleCount <= budget) {
+            return static_cast<int>(level);
+        }
     }
+    return static_cast<int>(lodLevels.size()) - 1;
+}
 
-    for (auto& normal : vertexNormals) {
-        float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
-        normal[0] /= length;
-        normal[1] /= length;
-        normal[2] /= length;
+// Um nivel de detalhe e desenhado inteiro, sem culling: so e escolhido quando
+// a malha ocupa pouco da tela. No wireframe os triangulos viram linhas pelo
+// glPolygonMode, ja que o buffer de arestas e o da malha completa.
+void drawLOD(int level, GLsizei instanceCount) {
+    const LODLevel& lod = lodLevels[level];
+    GLsizei count = static_cast<GLsizei>(lod.triangleCount * 3);
+    const void* offset = reinterpret_cast<const void*>(static_cast<size_t>(lod.firstIndex) * meshBuffers.indexSize);
+    glBindVertexArray(meshBuffers.lodArray);
+    if (currentDisplayMode == WIREFRAME) {
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     }
+    if (instanceCount > 0) {
+        glDrawElementsInstanced(GL_TRIANGLES, count, meshBuffers.indexType, offset, instanceCount);
+    } else {
+        glDrawElements(GL_TRIANGLES, count, meshBuffers.indexType, offset);
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(0);
+    cullStats.triangles += triangles.size();
+    cullStats.submittedTriangles += lod.triangleCount;
 }
-void scaleModel(float scaleFactor) {
-    for (auto& vertex : vertices) {
-        vertex.x *= scaleFactor;
-        vertex.y *= scaleFactor;
-        vertex.z *= scaleFactor;
+
+void drawMeshEdges() {
+    const DrawRanges& ranges = visibleRanges(&stackView, 1, true);
+    glBindVertexArray(meshBuffers.edgeArray);
+    glMultiDrawElements(GL_LINES, ranges.counts.data(), meshBuffers.indexType, ranges.offsets.data(),
+                        static_cast<GLsizei>(ranges.counts.size()));
+    glBindVertexArray(0);
+}
+
+// Preenchimento e contorno numa passada so: o geometry shader da a cada
+// vertice a distancia em pixels ate a aresta oposta, interpolada sem
+// perspectiva, e o fragment shader escurece o que estiver a menos de ~1 pixel
+// de alguma aresta. A iluminacao repete a fixa (GL_LIGHT0 com
+// GL_COLOR_MATERIAL em ambient e diffuse) para o visual nao mudar.
+// Entrada de vertice comum aos vertex shaders, inserida depois do #version.
+// Com QUANTIZED le os atributos compactos e desfaz a quantizacao; sem ele
+// repassa gl_Vertex e gl_Normal.
+const char* vertexInputShader = R"(
+#ifdef QUANTIZED
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+in vec4 quantizedPosition;
+in vec2 quantizedNormal;
+vec4 vertexPosition() {
+    return vec4(positionOffset + positionScale * quantizedPosition.xyz, 1.0);
+}
+vec3 vertexNormal() {
+    vec2 encoded = max(quantizedNormal, vec2(-1.0));
+    vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    if (normal.z < 0.0) {
+        vec2 signs = vec2(encoded.x >= 0.0 ? 1.0 : -1.0, encoded.y >= 0.0 ? 1.0 : -1.0);
+        normal.xy = (1.0 - abs(encoded.yx)) * signs;
     }
-    for (auto& vertex : transformedVertices) {
-        vertex.x *= scaleFactor;
-        vertex.y *= scaleFactor;
-        vertex.z *= scaleFactor;
+    return normalize(normal);
+}
+#else
+vec4 vertexPosition() {
+    return gl_Vertex;
+}
+vec3 vertexNormal() {
+    return gl_Normal;
+}
+#endif
+)";
+
+const char* outlineVertexShader = R"(#version 150 compatibility
+uniform bool lighting;
+in mat4 instanceTransform;
+in vec4 instanceColor;
+in mat3 instanceNormalMatrix;
+out vec4 vertexColor;
+void main() {
+    vec4 position = instanceTransform * vertexPosition();
+    gl_Position = gl_ModelViewProjectionMatrix * position;
+    if (!lighting) {
+        vertexColor = instanceColor;
+        return;
     }
-    for (auto& vertex : previousTransformedVertices) {
-        vertex.x *= scaleFactor;
-        vertex.y *= scaleFactor;
-        vertex.z *= scaleFactor;
+    vec3 normal = normalize(gl_NormalMatrix * (instanceNormalMatrix * vertexNormal()));
+    vec4 eyePosition = gl_ModelViewMatrix * position;
+    vec4 lightPosition = gl_LightSource[0].position;
+    vec3 toLight = normalize(lightPosition.xyz - eyePosition.xyz * lightPosition.w);
+    float diffuse = max(dot(normal, toLight), 0.0);
+    vec4 color = gl_FrontMaterial.emission + gl_LightModel.ambient * instanceColor
+               + gl_LightSource[0].ambient * instanceColor + diffuse * gl_LightSource[0].diffuse * instanceColor;
+    if (diffuse > 0.0) {
+        float highlight = max(dot(normal, normalize(toLight + vec3(0.0, 0.0, 1.0))), 0.0);
+        color += pow(highlight, gl_FrontMaterial.shininess) * gl_FrontMaterial.specular * gl_LightSource[0].specular;
     }
+    vertexColor = vec4(clamp(color.rgb, 0.0, 1.0), instanceColor.a);
 }
+)";
 
-void drawModelWireframe(const std::vector<Vertex>& modelVertices, const std::vector<Face>& modelFaces) {
-    glBegin(GL_LINES);
-    for (const auto& face : modelFaces) {
-        const Vertex& v1 = modelVertices[face.v1];
-        const Vertex& v2 = modelVertices[face.v2];
-        const Vertex& v3 = modelVertices[face.v3];
+const char* outlineGeometryShader = R"(#version 150 compatibility
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+uniform vec2 viewportSize;
+in vec4 vertexColor[];
+out vec4 fillColor;
+noperspective out vec3 edgeDistance;
+void main() {
+    vec2 p0 = 0.5 * viewportSize * gl_in[0].gl_Position.xy / gl_in[0].gl_Position.w;
+    vec2 p1 = 0.5 * viewportSize * gl_in[1].gl_Position.xy / gl_in[1].gl_Position.w;
+    vec2 p2 = 0.5 * viewportSize * gl_in[2].gl_Position.xy / gl_in[2].gl_Position.w;
+    vec2 e0 = p2 - p1;
+    vec2 e1 = p2 - p0;
+    vec2 e2 = p1 - p0;
+    float area = abs(e1.x * e2.y - e1.y * e2.x);
+    vec3 heights = area / max(vec3(length(e0), length(e1), length(e2)), 1e-6);
+    for (int i = 0; i < 3; ++i) {
+        gl_Position = gl_in[i].gl_Position;
+        fillColor = vertexColor[i];
+        edgeDistance = vec3(0.0);
+        edgeDistance[i] = heights[i];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
 
-        glVertex3f(v1.x, v1.y, v1.z);
-        glVertex3f(v2.x, v2.y, v2.z);
+const char* outlineFragmentShader = R"(#version 150 compatibility
+in vec4 fillColor;
+noperspective in vec3 edgeDistance;
+void main() {
+    float distance = min(edgeDistance.x, min(edgeDistance.y, edgeDistance.z));
+    float edge = 1.0 - smoothstep(0.0, 1.0, distance);
+    gl_FragColor = vec4(mix(fillColor.rgb, vec3(0.0), edge), fillColor.a);
+}
+)";
 
-        glVertex3f(v2.x, v2.y, v2.z);
-        glVertex3f(v3.x, v3.y, v3.z);
+const char* wireframeVertexShader = R"(#version 150 compatibility
+in mat4 instanceTransform;
+in vec4 instanceColor;
+out vec4 color;
+void main() {
+    gl_Position = gl_ModelViewProjectionMatrix * (instanceTransform * vertexPosition());
+    color = instanceColor;
+}
+)";
 
-        glVertex3f(v3.x, v3.y, v3.z);
-        glVertex3f(v1.x, v1.y, v1.z);
-    }
-    glEnd();
+const char* wireframeFragmentShader = R"(#version 150 compatibility
+in vec4 color;
+void main() {
+    gl_FragColor = color;
 }
+)";
 
-void drawModelFilled(const std::vector<Vertex>& modelVertices, const std::vector<Face>& modelFaces) {
-    glBegin(GL_TRIANGLES);
-    for (const auto& face : modelFaces) {
-        const Vertex& v1 = modelVertices[face.v1];
-        const Vertex& v2 = modelVertices[face.v2];
-        const Vertex& v3 = modelVertices[face.v3];
+// Atributos por instancia: a matriz ocupa as locacoes 4 a 7 (uma por coluna),
+// a cor a 8 e a matriz das normais de 9 a 11, longe da 0, que se confunde com
+// gl_Vertex. Os atributos quantizados ficam na 0 e na 1, ja que substituem
+// gl_Vertex.
+const GLuint quantizedPositionLocation = 0;
+const GLuint quantizedNormalLocation = 1;
+const GLuint instanceTransformLocation = 4;
+const GLuint instanceColorLocation = 8;
+const GLuint instanceNormalMatrixLocation = 9;
 
-        const auto& n1 = vertexNormals[face.v1];
-        const auto& n2 = vertexNormals[face.v2];
-        const auto& n3 = vertexNormals[face.v3];
+GLuint outlineProgram = 0;
+GLint outlineLightingUniform = -1;
+GLint outlineViewportUniform = -1;
+GLuint wireframeProgram = 0;
+GLuint instanceBuffer = 0;
+// Copia do que esta no instanceBuffer, usada no culling.
+std::vector<ModelView> instanceViews;
+bool instancedRendering = false;
 
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "Failed to compile shader: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
 
-        glNormal3f(n1[0], n1[1], n1[2]);
-        glVertex3f(v1.x, v1.y, v1.z);
-        glNormal3f(n2[0], n2[1], n2[2]);
-        glVertex3f(v2.x, v2.y, v2.z);
-        glNormal3f(n3[0], n3[1], n3[2]);
-        glVertex3f(v3.x, v3.y, v3.z);
+// Insere vertexInputShader logo depois da linha do #version.
+std::string vertexShaderSource(const char* source) {
+    std::string text = source;
+    std::string input = quantizedRendering ? "#define QUANTIZED\n" : "";
+    text.insert(text.find('\n') + 1, input + vertexInputShader);
+    return text;
+}
+
+GLuint linkProgram(const char* vertexSource, const char* geometrySource, const char* fragmentSource) {
+    std::string vertexText = vertexShaderSource(vertexSource);
+    std::vector<GLuint> shaders = {compileShader(GL_VERTEX_SHADER, vertexText.c_str()),
+                                   compileShader(GL_FRAGMENT_SHADER, fragmentSource)};
+    if (geometrySource) {
+        shaders.push_back(compileShader(GL_GEOMETRY_SHADER, geometrySource));
     }
-    glEnd();
+    GLuint program = glCreateProgram();
+    for (GLuint shader : shaders) {
+        if (shader != 0) {
+            glAttachShader(program, shader);
+        }
+    }
+    glBindAttribLocation(program, quantizedPositionLocation, "quantizedPosition");
+    glBindAttribLocation(program, quantizedNormalLocation, "quantizedNormal");
+    glBindAttribLocation(program, instanceTransformLocation, "instanceTransform");
+    glBindAttribLocation(program, instanceColorLocation, "instanceColor");
+    glBindAttribLocation(program, instanceNormalMatrixLocation, "instanceNormalMatrix");
+    glLinkProgram(program);
+    for (GLuint shader : shaders) {
+        glDeleteShader(shader);
+    }
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "Failed to link shader program: " << log << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
 
-    glColor3f(0.0f, 0.0f, 0.0f); // Preto para as arestas
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glBegin(GL_TRIANGLES);
-    for (const auto& face : modelFaces) {
-        const Vertex& v1 = modelVertices[face.v1];
-        const Vertex& v2 = modelVertices[face.v2];
-        const Vertex& v3 = modelVertices[face.v3];
+// Os programas com instancias precisam de GL 3.3 (divisor de atributo e
+// geometry shader). Sem eles cada estado e desenhado a parte pelo pipeline
+// fixo, com o contorno numa segunda passada pelas arestas, e a malha vai em
+// float mesmo com --quantize.
+bool initInstancedRendering() {
+    if (!GLEW_VERSION_3_3) {
+        return false;
+    }
+    quantizedRendering = quantizeEnabled;
+    outlineProgram = linkProgram(outlineVertexShader, outlineGeometryShader, outlineFragmentShader);
+    wireframeProgram = linkProgram(wireframeVertexShader, nullptr, wireframeFragmentShader);
+    if (outlineProgram == 0 || wireframeProgram == 0) {
+        quantizedRendering = false;
+        return false;
+    }
+    outlineLightingUniform = glGetUniformLocation(outlineProgram, "lighting");
+    outlineViewportUniform = glGetUniformLocation(outlineProgram, "viewportSize");
 
+    glGenBuffers(1, &instanceBuffer);
+    for (GLuint vertexArray : {meshBuffers.vertexArray, meshBuffers.edgeArray, meshBuffers.lodArray}) {
+        glBindVertexArray(vertexArray);
+        for (GLuint location = instanceTransformLocation; location <= instanceNormalMatrixLocation + 2; ++location) {
+            glEnableVertexAttribArray(location);
+            glVertexAttribDivisor(location, 1);
+        }
+        if (quantizedRendering) {
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+            glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.positionBuffer);
+            glEnableVertexAttribArray(quantizedPositionLocation);
+            glVertexAttribPointer(quantizedPositionLocation, 4, GL_UNSIGNED_SHORT, GL_TRUE, 0, nullptr);
+            glBindBuffer(GL_ARRAY_BUFFER, meshBuffers.normalBuffer);
+            glEnableVertexAttribArray(quantizedNormalLocation);
+            glVertexAttribPointer(quantizedNormalLocation, 2, GL_SHORT, GL_TRUE, 0, nullptr);
+        }
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
+}
 
-        const auto& n1 = vertexNormals[face.v1];
-        const auto& n2 = vertexNormals[face.v2];
-        const auto& n3 = vertexNormals[face.v3];
+// Caixa usada na quantizacao, que muda a cada envio da malha.
+void setQuantizationUniforms(GLuint program) {
+    if (!quantizedRendering) {
+        return;
+    }
+    glUniform3fv(glGetUniformLocation(program, "positionOffset"), 1, meshBuffers.positionOffset);
+    glUniform3fv(glGetUniformLocation(program, "positionScale"), 1, meshBuffers.positionScale);
+}
 
-        glNormal3f(n1[0], n1[1], n1[2]);
-        glVertex3f(v1.x, v1.y, v1.z);
-        glNormal3f(n2[0], n2[1], n2[2]);
-        glVertex3f(v2.x, v2.y, v2.z);
-        glNormal3f(n3[0], n3[1], n3[2]);
-        glVertex3f(v3.x, v3.y, v3.z);
+// Desenha as instancias [first, first + count) do instanceBuffer com o
+// programa do modo atual: uma chamada por faixa visivel em alguma delas.
+void drawInstances(size_t first, size_t count) {
+    int level = selectLOD(instanceViews.data() + first, count);
+    GLuint vertexArray = meshBuffers.edgeArray;
+    GLenum primitive = GL_LINES;
+    if (currentDisplayMode == FILLED) {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glUseProgram(outlineProgram);
+        setQuantizationUniforms(outlineProgram);
+        glUniform1i(outlineLightingUniform, glIsEnabled(GL_LIGHTING));
+        glUniform2f(outlineViewportUniform, static_cast<float>(viewport[2]), static_cast<float>(viewport[3]));
+        vertexArray = meshBuffers.vertexArray;
+        primitive = GL_TRIANGLES;
+    } else {
+        glUseProgram(wireframeProgram);
+        setQuantizationUniforms(wireframeProgram);
     }
-    glEnd();
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    if (level >= 0) {
+        vertexArray = meshBuffers.lodArray;
+    }
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    const char* base = reinterpret_cast<const char*>(first * sizeof(ModelView));
+    for (GLuint column = 0; column < 4; ++column) {
+        glVertexAttribPointer(instanceTransformLocation + column, 4, GL_FLOAT, GL_FALSE, sizeof(ModelView),
+                              base + offsetof(ModelView, transform) + column * 4 * sizeof(GLfloat));
+    }
+    glVertexAttribPointer(instanceColorLocation, 4, GL_FLOAT, GL_FALSE, sizeof(ModelView),
+                          base + offsetof(ModelView, color));
+    for (GLuint column = 0; column < 3; ++column) {
+        glVertexAttribPointer(instanceNormalMatrixLocation + column, 3, GL_FLOAT, GL_FALSE, sizeof(ModelView),
+                              base + offsetof(ModelView, normalMatrix) + column * 3 * sizeof(GLfloat));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (level >= 0) {
+        drawLOD(level, static_cast<GLsizei>(count));
+        glUseProgram(0);
+        return;
+    }
+    const DrawRanges& ranges = visibleRanges(instanceViews.data() + first, count, primitive == GL_LINES);
+    for (size_t i = 0; i < ranges.counts.size(); ++i) {
+        glDrawElementsInstanced(primitive, ranges.counts[i], meshBuffers.indexType, ranges.offsets[i],
+                                static_cast<GLsizei>(count));
+    }
+    glBindVertexArray(0);
+    glUseProgram(0);
 }
-void drawModel(const std::vector<Vertex>& modelVertices, const std::vector<Face>& modelFaces) {
+
+void drawModelBuffered() {
+    int level = selectLOD(&stackView, 1);
+    if (level >= 0) {
+        drawLOD(level, 0);
+        if (currentDisplayMode == FILLED) {
+            glColor3f(0.0f, 0.0f, 0.0f); // Preto para as arestas
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            drawLOD(level, 0);
+        }
+        return;
+    }
     if (currentDisplayMode == WIREFRAME) {
-        drawModelWireframe(modelVertices, modelFaces);
+        drawMeshEdges();
+    } else if (currentDisplayMode == FILLED) {
+        const DrawRanges& ranges = visibleRanges(&stackView, 1, false);
+        glBindVertexArray(meshBuffers.vertexArray);
+        glMultiDrawElements(GL_TRIANGLES, ranges.counts.data(), meshBuffers.indexType, ranges.offsets.data(),
+                            static_cast<GLsizei>(ranges.counts.size()));
+        glBindVertexArray(0);
+        glColor3f(0.0f, 0.0f, 0.0f); // Preto para as arestas
+        drawMeshEdges();
+    }
+}
+
+void drawModel(const ModelView& view) {
+    glPushMatrix();
+    glMultMatrixf(view.transform.m);
+    glColor4fv(view.color);
+    if (bufferedRendering) {
+        drawModelBuffered();
+    } else if (currentDisplayMode == WIREFRAME) {
+        drawModelWireframe();
     } else if (currentDisplayMode == FILLED) {
-        drawModelFilled(modelVertices, modelFaces);
+        drawModelFilled();
     }
+    glPopMatrix();
 }
 
 void draw_axes() {
@@ -294,113 +4192,427 @@ void setupLight() {
     glEnable(GL_COLOR_MATERIAL);
     glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
 }
-void copyModel() {
-    transformedVertices = vertices;
-    transformedFaces = faces;
-    previousTransformedVertices = vertices;
-    previousTransformedFaces= faces;
-}
 
 void disableLight() {
     glDisable(GL_LIGHTING);
     glDisable(GL_LIGHT0);
 }
-void applyScale(float sx, float sy, float sz) {
+// Produtos acumulados das transformacoes: transformationMatrices[i] e o
+// resultado de aplicar as transformacoes 0..i em sequencia.
+std::vector<Matrix4> transformationMatrices;
+
+void applyScale(Matrix4& matrix, float sx, float sy, float sz) {
     if (std::isfinite(sx) && std::isfinite(sy) && std::isfinite(sz)) {
-        glScalef(sx, sy, sz);
-        std::cout << "Scaling: " << sx << ", " << sy << ", " << sz << std::endl;
+        Matrix4 scale = identityMatrix();
+        scale.m[0] = sx;
+        scale.m[5] = sy;
+        scale.m[10] = sz;
+        matrix = multiplyMatrix(matrix, scale);
+        traceEvent(TRACE_DEBUG, TRACE_SCALE, -1, sx, sy, sz);
     }
 }
-void applyTranslation(float tx, float ty, float tz) {
-    glTranslatef(tx, ty, tz);
-    std::cout << "Translation: " << tx << ", " << ty << ", " << tz << std::endl;
+void applyTranslation(Matrix4& matrix, float tx, float ty, float tz) {
+    Matrix4 translation = identityMatrix();
+    translation.m[12] = tx;
+    translation.m[13] = ty;
+    translation.m[14] = tz;
+    matrix = multiplyMatrix(matrix, translation);
+    traceEvent(TRACE_DEBUG, TRACE_TRANSLATION, -1, tx, ty, tz);
+}
+// Mesma matriz de glRotatef para um eixo unitario.
+void applyRotation(Matrix4& matrix, float angle, float x, float y, float z) {
+    float radians = angle * static_cast<float>(M_PI) / 180.0f;
+    float c = std::cos(radians);
+    float s = std::sin(radians);
+    float t = 1.0f - c;
+    Matrix4 rotation = {{x * x * t + c, y * x * t + z * s, x * z * t - y * s, 0.0f,
+                         x * y * t - z * s, y * y * t + c, y * z * t + x * s, 0.0f,
+                         x * z * t + y * s, y * z * t - x * s, z * z * t + c, 0.0f,
+                         0.0f, 0.0f, 0.0f, 1.0f}};
+    matrix = multiplyMatrix(matrix, rotation);
 }
-void applyRotationX(float angle) {
-    glRotatef(angle, 1.0f, 0.0f, 0.0f);
-    std::cout << "Rotation X: " << angle << std::endl;
+void applyRotationX(Matrix4& matrix, float angle) {
+    applyRotation(matrix, angle, 1.0f, 0.0f, 0.0f);
+    traceEvent(TRACE_DEBUG, TRACE_ROTATION_X, -1, angle);
 }
-void applyRotationY(float angle) {
-    glRotatef(angle, 0.0f, 1.0f, 0.0f);
-    std::cout << "Rotation Y: " << angle << std::endl;
+void applyRotationY(Matrix4& matrix, float angle) {
+    applyRotation(matrix, angle, 0.0f, 1.0f, 0.0f);
+    traceEvent(TRACE_DEBUG, TRACE_ROTATION_Y, -1, angle);
 }
-void applyRotationZ(float angle) {
-    glRotatef(angle, 0.0f, 0.0f, 1.0f);
-    std::cout << "Rotation Z: " << angle << std::endl;
+void applyRotationZ(Matrix4& matrix, float angle) {
+    applyRotation(matrix, angle, 0.0f, 0.0f, 1.0f);
+    traceEvent(TRACE_DEBUG, TRACE_ROTATION_Z, -1, angle);
 }
-void applyShearing(float shx, float shy, float shz) {
+void applyShearing(Matrix4& matrix, float shx, float shy, float shz) {
     if (shx != 0) {
-        GLfloat shear[] = {
+        Matrix4 shear = {{
                 1.0, 0.0, 0.0, 0.0,
                 shy, 1.0, shz, 0.0,
                 0.0, 0.0, 1.0, 0.0,
                 0.0, 0.0, 0.0, 1.0
-        };
-        glMultMatrixf(shear);
+        }};
+        matrix = multiplyMatrix(matrix, shear);
     } else if (shy != 0) {
-        GLfloat shear[] = {
+        Matrix4 shear = {{
                 1.0, shx, 0.0, 0.0,
                 0.0, 1.0, 0.0, 0.0,
                 0.0, shz, 1.0, 0.0,
                 0.0, 0.0, 0.0, 1.0
-        };
-        glMultMatrixf(shear);
+        }};
+        matrix = multiplyMatrix(matrix, shear);
     } else if (shz != 0) {
-        GLfloat shear[] = {
+        Matrix4 shear = {{
                 1.0, 0.0, shx, 0.0,
                 0.0, 1.0, shy, 0.0,
                 0.0, 0.0, 1.0, 0.0,
                 0.0, 0.0, 0.0, 1.0
-        };
-        glMultMatrixf(shear);
+        }};
+        matrix = multiplyMatrix(matrix, shear);
     }
-    std::cout << "Shearing: " << shx << ", " << shy << ", " << shz << std::endl;
+    traceEvent(TRACE_DEBUG, TRACE_SHEARING, -1, shx, shy, shz);
 }
-void applyReflection(float ex, float ey, float ez) {
-    GLfloat reflect[16] = {
+void applyReflection(Matrix4& matrix, float ex, float ey, float ez) {
+    Matrix4 reflect = {{
             ex == 1 ? -1.0f : 1.0f, 0.0f, 0.0f, 0.0f,
             0.0f, ey == 1 ? -1.0f : 1.0f, 0.0f, 0.0f,
             0.0f, 0.0f, ez == 1 ? -1.0f : 1.0f, 0.0f,
             0.0f, 0.0f, 0.0f, 1.0f
-    };
-    glMultMatrixf(reflect);
-    std::cout << "Reflection: " << ex << ", " << ey << ", " << ez << std::endl;
-}
-
-void applyTransformations(int transformationIndex) {
-    for (int i = 0; i <= transformationIndex; ++i) {
-        std::istringstream iss(transformations[i]);
-        std::string type;
-        iss >> type;
-
-        if (type == "s") {
-            float sx, sy, sz;
-            iss >> sx >> sy >> sz;
-            applyScale(sx, sy, sz);
-        } else if (type == "t") {
-            float tx, ty, tz;
-            iss >> tx >> ty >> tz;
-            applyTranslation(tx, ty, tz);
-        } else if (type == "x") {
-            float angle;
-            iss >> angle;
-            applyRotationX(angle);
-        } else if (type == "y") {
-            float angle;
-            iss >> angle;
-            applyRotationY(angle);
-        } else if (type == "z") {
-            float angle;
-            iss >> angle;
-            applyRotationZ(angle);
-        } else if (type == "c") {
-            float shx, shy, shz;
-            iss >> shx >> shy >> shz;
-            applyShearing(shx, shy, shz);
-        } else if (type == "e") {
-            float ex, ey, ez;
-            iss >> ex >> ey >> ez;
-            applyReflection(ex, ey, ez);
+    }};
+    matrix = multiplyMatrix(matrix, reflect);
+    traceEvent(TRACE_DEBUG, TRACE_REFLECTION, -1, ex, ey, ez);
+}
+
+// Le ate count floats da linha; os que faltarem ficam NaN.
+void parseTransformationArguments(const std::string& line, float* values, int count) {
+    const char* p = line.data();
+    const char* end = p + line.size();
+    p = skipToken(skipSpaces(p, end), end);
+    for (int i = 0; i < count; ++i) {
+        values[i] = std::numeric_limits<float>::quiet_NaN();
+        p = parseFloat(p, end, values[i]);
+    }
+}
+
+// Aplica uma linha de transformacao (s, t, x, y, z, c ou e) sobre matrix. Se
+// faltar algum argumento (ou nao for finito), o passo nao muda a matriz.
+void applyTransformation(Matrix4& matrix, const std::string& transformation) {
+    const char* p = skipSpaces(transformation.data(), transformation.data() + transformation.size());
+    char type = *p;
+    if (!isTransformationType(type)) {
+        return;
+    }
+    int count = type == 'x' || type == 'y' || type == 'z' ? 1 : 3;
+    float a[3];
+    parseTransformationArguments(transformation, a, count);
+    for (int i = 0; i < count; ++i) {
+        if (!std::isfinite(a[i])) {
+            return;
+        }
+    }
+    if (type == 's') {
+        applyScale(matrix, a[0], a[1], a[2]);
+    } else if (type == 't') {
+        applyTranslation(matrix, a[0], a[1], a[2]);
+    } else if (type == 'x') {
+        applyRotationX(matrix, a[0]);
+    } else if (type == 'y') {
+        applyRotationY(matrix, a[0]);
+    } else if (type == 'z') {
+        applyRotationZ(matrix, a[0]);
+    } else if (type == 'c') {
+        applyShearing(matrix, a[0], a[1], a[2]);
+    } else if (type == 'e') {
+        applyReflection(matrix, a[0], a[1], a[2]);
+    }
+}
+
+// Muda a cada compileTransformations(), para quem guarda copias das matrizes.
+uint64_t transformationsVersion = 0;
+
+// Converte as linhas de transformacao em matrizes uma unica vez, guardando o
+// produto acumulado de cada passo. Desenhar o passo k passa a ser um unico
+// glMultMatrixf, independente do tamanho da sequencia.
+void compileTransformations() {
+    ++transformationsVersion;
+    transformationMatrices.clear();
+    transformationMatrices.reserve(transformations.size());
+    Matrix4 matrix = identityMatrix();
+    for (const auto& transformation : transformations) {
+        applyTransformation(matrix, transformation);
+        transformationMatrices.push_back(matrix);
+    }
+}
+
+// Cena: varios .obj juntados na mesma malha global, cada um com a sua
+// transformacao aplicada na carga. Como a geometria vira uma so, os buffers da
+// GPU, a BVH, os clusters e os niveis de detalhe cobrem a cena inteira e o
+// numero de chamadas de desenho nao cresce com o numero de pecas. Cada objeto
+// guarda as faixas que ocupa nos arrays globais.
+struct SceneObject {
+    std::string path;
+    Matrix4 transform;
+    uint32_t firstVertex = 0;
+    uint32_t vertexCount = 0;
+    uint32_t firstFace = 0;
+    uint32_t faceCount = 0;
+    uint32_t firstTriangle = 0;
+    uint32_t triangleCount = 0;
+};
+
+std::vector<SceneObject> sceneObjects;
+
+// Objetos na ordem da linha de comando: cada caminho solto e cada --scene
+// formam um grupo. Na janela os grupos viram uma cena so; no --headless cada
+// grupo e renderizado a parte.
+struct SceneGroup {
+    std::string name;
+    size_t firstObject = 0;
+    size_t objectCount = 0;
+};
+
+std::vector<SceneGroup> sceneGroups;
+
+// Nome do arquivo sem pasta e sem extensao.
+std::string fileStem(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+void addSceneObject(const std::string& path) {
+    SceneObject object;
+    object.path = path;
+    object.transform = identityMatrix();
+    sceneObjects.push_back(object);
+    ++sceneGroups.back().objectCount;
+}
+
+// Le um arquivo de cena: cada linha e o caminho de um .obj ou uma linha de
+// transformacao (s, t, x, y, z, c ou e, como no .obj) que se acumula sobre a
+// do ultimo objeto. Linhas vazias e comecadas por # sao ignoradas. Caminhos
+// relativos sao resolvidos a partir da pasta do arquivo de cena.
+bool readSceneFile(const char* path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open scene: " << path << std::endl;
+        return false;
+    }
+    sceneGroups.push_back({fileStem(path), sceneObjects.size(), 0});
+    std::string directory = path;
+    size_t slash = directory.find_last_of('/');
+    directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+    std::string line;
+    while (std::getline(file, line)) {
+        const char* end = line.data() + line.size();
+        std::string text(skipSpaces(line.data(), end), end);
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+            text.pop_back();
+        }
+        if (text.empty() || text[0] == '#') {
+            continue;
+        }
+        bool transformation = text.size() > 1 && std::strchr("stxyzce", text[0]) && (text[1] == ' ' || text[1] == '\t');
+        if (transformation) {
+            if (sceneObjects.empty()) {
+                std::cerr << "Transformation before the first object in " << path << ": " << text << std::endl;
+                return false;
+            }
+            applyTransformation(sceneObjects.back().transform, text);
+            continue;
+        }
+        addSceneObject(text[0] == '/' ? text : directory + text);
+    }
+    return true;
+}
+
+bool isIdentity(const Matrix4& matrix) {
+    Matrix4 identity = identityMatrix();
+    return std::equal(matrix.m, matrix.m + 16, identity.m);
+}
+
+// Carrega os objetos de sceneObjects um a um nas globais, aplica a
+// transformacao de cada um e os junta, com os indices deslocados pelos
+// vertices dos anteriores. O primeiro e trocado em vez de copiado, entao uma
+// cena de um objeto custa o mesmo que loadMesh(). As transformacoes da
+// sequencia sao as do primeiro arquivo que tiver alguma.
+bool loadScene() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Vertex> sceneVertices;
+    std::vector<uint32_t> sceneFaceOffsets;
+    std::vector<int> sceneFaceIndices;
+    std::vector<float> sceneTexcoords;
+    std::vector<Triangle> sceneTriangles;
+    AlignedFloats sceneTriangleNormals;
+    AlignedFloats sceneVertexNormals;
+    std::vector<std::string> sceneTransformations;
+    bool sceneAuthoredNormals = true;
+    bool sceneHasTexcoords = false;
+    double sceneMisses = 0.0;
+
+    for (size_t i = 0; i < sceneObjects.size(); ++i) {
+        SceneObject& object = sceneObjects[i];
+        // Nada do objeto anterior (ou da cena do grupo anterior) pode sobrar
+        // nas globais, nem quando o objeto vem do cache.
+        clearParsedOBJ();
+        loadedACMR = 0.0;
+        vertexTriangleOffsets.clear();
+        vertexTriangles.clear();
+        if (!loadMeshGeometry(object.path.c_str())) {
+            return false;
+        }
+        if (!isIdentity(object.transform)) {
+            bakeTransform(object.transform, true);
+        }
+        if (sceneMisses >= 0.0 && loadedACMR > 0.0) {
+            sceneMisses += loadedACMR * triangles.size();
+        } else {
+            sceneMisses = -1.0;
+        }
+        size_t vertexBase = sceneVertices.size();
+        object.firstVertex = static_cast<uint32_t>(vertexBase);
+        object.vertexCount = static_cast<uint32_t>(vertices.size());
+        object.firstFace = static_cast<uint32_t>(sceneFaceOffsets.empty() ? 0 : sceneFaceOffsets.size() - 1);
+        object.faceCount = static_cast<uint32_t>(faceOffsets.size() - 1);
+        object.firstTriangle = static_cast<uint32_t>(sceneTriangles.size());
+        object.triangleCount = static_cast<uint32_t>(triangles.size());
+        sceneAuthoredNormals = sceneAuthoredNormals && authoredNormals;
+        if (sceneTransformations.empty()) {
+            sceneTransformations = transformations;
+        }
+        bool hasTexcoords = vertexTexcoords.size() == vertices.size() * 2;
+        if (hasTexcoords && !sceneHasTexcoords) {
+            sceneTexcoords.assign(vertexBase * 2, 0.0f);
+            sceneHasTexcoords = true;
+        }
+        if (sceneHasTexcoords && !hasTexcoords) {
+            vertexTexcoords.assign(vertices.size() * 2, 0.0f);
+        }
+        if (i == 0) {
+            sceneVertices.swap(vertices);
+            sceneFaceOffsets.swap(faceOffsets);
+            sceneFaceIndices.swap(faceIndices);
+            sceneTexcoords.swap(vertexTexcoords);
+            sceneTriangles.swap(triangles);
+            sceneTriangleNormals.swap(triangleNormals);
+            sceneVertexNormals.swap(vertexNormals);
+            continue;
+        }
+        int base = static_cast<int>(vertexBase);
+        uint32_t indexBase = static_cast<uint32_t>(sceneFaceIndices.size());
+        sceneVertices.insert(sceneVertices.end(), vertices.begin(), vertices.end());
+        for (size_t f = 1; f < faceOffsets.size(); ++f) {
+            sceneFaceOffsets.push_back(faceOffsets[f] + indexBase);
+        }
+        for (int index : faceIndices) {
+            sceneFaceIndices.push_back(index + base);
+        }
+        if (sceneHasTexcoords) {
+            sceneTexcoords.insert(sceneTexcoords.end(), vertexTexcoords.begin(), vertexTexcoords.end());
+        }
+        for (const Triangle& face : triangles) {
+            sceneTriangles.push_back({face.v1 + base, face.v2 + base, face.v3 + base});
+        }
+        sceneTriangleNormals.insert(sceneTriangleNormals.end(), triangleNormals.begin(), triangleNormals.end());
+        sceneVertexNormals.insert(sceneVertexNormals.end(), vertexNormals.begin(), vertexNormals.end());
+    }
+
+    vertices.swap(sceneVertices);
+    faceOffsets.swap(sceneFaceOffsets);
+    faceIndices.swap(sceneFaceIndices);
+    vertexTexcoords.swap(sceneTexcoords);
+    triangles.swap(sceneTriangles);
+    triangleNormals.swap(sceneTriangleNormals);
+    vertexNormals.swap(sceneVertexNormals);
+    transformations.swap(sceneTransformations);
+    authoredNormals = sceneAuthoredNormals;
+    loadedACMR = sceneMisses > 0.0 && !triangles.empty() ? sceneMisses / triangles.size() : 0.0;
+    if (sceneObjects.size() > 1) {
+        vertexTriangleOffsets.clear();
+        vertexTriangles.clear();
+    }
+    buildMeshStructures();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Scene: " << sceneObjects.size() << " objects, " << vertices.size() << " vertices, "
+              << triangles.size() << " triangles in " << elapsed.count() << " ms" << std::endl;
+    return true;
+}
+
+// Produto acumulado ate o passo transformationIndex (identidade antes do primeiro).
+Matrix4 transformationMatrix(int transformationIndex) {
+    if (transformationIndex >= 0 && transformationIndex < static_cast<int>(transformationMatrices.size())) {
+        return transformationMatrices[transformationIndex];
+    }
+    return identityMatrix();
+}
+
+// Matriz do estado "atual" no passo k, mantendo o aninhamento original.
+Matrix4 stepMatrix(int transformationIndex) {
+    return multiplyMatrix(transformationMatrix(transformationIndex - 1), transformationMatrix(transformationIndex));
+}
+
+// Estados exibidos no passo atual: o modelo original (azul) antes da primeira
+// transformacao; depois, o passo anterior (verde) e o atual (vermelho). O atual
+// e aplicado sobre o anterior, como na pilha de matrizes usada antes.
+std::vector<ModelView> currentModelViews() {
+    if (currentTransformationIndex < 0) {
+        return {{identityMatrix(), {0.0f, 0.0f, 1.0f, 1.0f}}};
+    }
+    Matrix4 previous = transformationMatrix(currentTransformationIndex - 1);
+    return {{previous, {0.0f, 1.0f, 0.0f, 1.0f}}, {stepMatrix(currentTransformationIndex), {1.0f, 0.0f, 0.0f, 1.0f}}};
+}
+
+// Com G ligado, cada passo da sequencia aparece como um fantasma translucido.
+bool showGhosts = false;
+
+std::vector<ModelView> ghostModelViews() {
+    std::vector<ModelView> ghosts;
+    if (!showGhosts) {
+        return ghosts;
+    }
+    ghosts.reserve(transformationMatrices.size());
+    for (int k = 0; k < static_cast<int>(transformationMatrices.size()); ++k) {
+        ghosts.push_back({stepMatrix(k), {0.9f, 0.9f, 0.9f, 0.25f}});
+    }
+    return ghosts;
+}
+
+// Estados exibidos e fantasmas saem do mesmo instanceBuffer: os opacos numa
+// chamada e os fantasmas em outra, com blend e sem escrever profundidade. O
+// buffer so e reenviado quando o passo ou os fantasmas mudam.
+void drawModelInstances() {
+    static int uploadedIndex = -2;
+    static bool uploadedGhosts = false;
+    static uint64_t uploadedVersion = 0;
+    static size_t viewCount = 0;
+    static size_t ghostCount = 0;
+    if (uploadedIndex != currentTransformationIndex || uploadedGhosts != showGhosts ||
+        uploadedVersion != transformationsVersion) {
+        instanceViews = currentModelViews();
+        std::vector<ModelView> ghosts = ghostModelViews();
+        viewCount = instanceViews.size();
+        ghostCount = ghosts.size();
+        instanceViews.insert(instanceViews.end(), ghosts.begin(), ghosts.end());
+        for (ModelView& view : instanceViews) {
+            setNormalMatrix(view);
         }
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, instanceViews.size() * sizeof(ModelView), instanceViews.data(),
+                     GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        uploadedIndex = currentTransformationIndex;
+        uploadedGhosts = showGhosts;
+        uploadedVersion = transformationsVersion;
+    }
+    drawInstances(0, viewCount);
+    if (ghostCount > 0) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDepthMask(GL_FALSE);
+        drawInstances(viewCount, ghostCount);
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
     }
 }
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
@@ -419,6 +4631,9 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             disableLight();
         }
     }
+    if (key == GLFW_KEY_G && action == GLFW_PRESS) {
+        showGhosts = !showGhosts;
+    }
     if ((key == GLFW_KEY_Q || key == GLFW_KEY_ESCAPE) && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, GLFW_TRUE);
     }
@@ -427,7 +4642,6 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             currentTransformationIndex++;
         } else {
             currentTransformationIndex = -1;
-            copyModel();
         }
 
     }
@@ -471,28 +4685,341 @@ void setupMaterial() {
     glMaterialf(GL_FRONT, GL_SHININESS, modelShininess);
 }
 
+// Desenha um frame inteiro no framebuffer atual: eixos e os estados do passo
+// currentTransformationIndex.
+void renderFrame() {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (lightEnabled && currentDisplayMode == FILLED) {
+        glEnable(GL_LIGHTING);
+    } else {
+        glDisable(GL_LIGHTING);
+    }
+
+
+    glPushMatrix();
+    glRotatef(rotationX, 1.0f, 0.0f, 0.0f);
+    glRotatef(rotationY, 0.0f, 1.0f, 0.0f);
+
+    draw_axes();
+    setupMaterial();
+    if (bufferedRendering) {
+        uploadMeshBuffers();
+        uploadLODBuffers();
+    }
+    cullStats = CullStats();
+    if (instancedRendering) {
+        drawModelInstances();
+    } else {
+        for (const auto& view : currentModelViews()) {
+            drawModel(view);
+        }
+    }
+
+    glPopMatrix();
+}
+
+// Modo --headless: sem janela nem display, renderiza por um contexto EGL
+// surfaceless (serve o llvmpipe) num framebuffer object e grava um PNG por
+// passo de transformacao de cada grupo da linha de comando, em
+// <output>/<nome>_<passo>.png, com o passo 0 sendo o modelo original. O
+// contexto, o GLEW e os shaders sao criados uma vez para todos os arquivos.
+bool headlessMode = false;
+std::string outputDirectory = ".";
+const int headlessWidth = 640;
+const int headlessHeight = 480;
+
+struct HeadlessContext {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    GLuint framebuffer = 0;
+    GLuint renderbuffers[2] = {0, 0};
+};
+
+HeadlessContext headlessContext;
+
+bool createHeadlessContext() {
+    auto getPlatformDisplay =
+        reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    EGLDisplay display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "Failed to initialize EGL" << std::endl;
+        return false;
+    }
+    headlessContext.display = display;
+    // Sem nenhuma config de OpenGL, tenta um contexto sem config
+    // (EGL_KHR_no_config_context), que basta para desenhar no FBO.
+    const EGLint configAttributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config = nullptr;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+        config = EGL_NO_CONFIG_KHR;
+    }
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, nullptr);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        std::cerr << "Failed to create an offscreen OpenGL context" << std::endl;
+        return false;
+    }
+    headlessContext.context = context;
+    return true;
+}
+
+// Cor e profundidade em renderbuffers; precisa do GLEW ja iniciado.
+bool createHeadlessFramebuffer(int width, int height) {
+    glGenFramebuffers(1, &headlessContext.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headlessContext.framebuffer);
+    glGenRenderbuffers(2, headlessContext.renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, headlessContext.renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headlessContext.renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, headlessContext.renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headlessContext.renderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Offscreen framebuffer is incomplete" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void destroyHeadlessContext() {
+    if (headlessContext.framebuffer != 0) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &headlessContext.framebuffer);
+        glDeleteRenderbuffers(2, headlessContext.renderbuffers);
+    }
+    if (headlessContext.display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(headlessContext.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (headlessContext.context != EGL_NO_CONTEXT) {
+            eglDestroyContext(headlessContext.display, headlessContext.context);
+        }
+        eglTerminate(headlessContext.display);
+    }
+    headlessContext = HeadlessContext();
+}
+
+// PNG RGB de 8 bits. As linhas chegam de baixo para cima, como o glReadPixels
+// as entrega.
+bool writePNG(const std::string& path, int width, int height, const std::vector<unsigned char>& pixels) {
+    size_t rowBytes = static_cast<size_t>(width) * 3;
+    std::vector<unsigned char> raw;
+    raw.reserve((rowBytes + 1) * height);
+    for (int y = height - 1; y >= 0; --y) {
+        raw.push_back(0);
+        raw.insert(raw.end(), pixels.begin() + y * rowBytes, pixels.begin() + (y + 1) * rowBytes);
+    }
+    uLongf compressedSize = compressBound(raw.size());
+    std::vector<unsigned char> compressed(compressedSize);
+    if (compress2(compressed.data(), &compressedSize, raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    auto writeUint32 = [](unsigned char* out, uint32_t value) {
+        out[0] = static_cast<unsigned char>(value >> 24);
+        out[1] = static_cast<unsigned char>(value >> 16);
+        out[2] = static_cast<unsigned char>(value >> 8);
+        out[3] = static_cast<unsigned char>(value);
+    };
+    auto writeChunk = [&](const char* type, const unsigned char* data, size_t length) {
+        unsigned char header[8];
+        writeUint32(header, static_cast<uint32_t>(length));
+        std::memcpy(header + 4, type, 4);
+        unsigned char footer[4];
+        uLong crc = crc32(0, header + 4, 4);
+        if (length > 0) {
+            crc = crc32(crc, data, static_cast<uInt>(length));
+        }
+        writeUint32(footer, static_cast<uint32_t>(crc));
+        file.write(reinterpret_cast<const char*>(header), 8);
+        file.write(reinterpret_cast<const char*>(data), length);
+        file.write(reinterpret_cast<const char*>(footer), 4);
+    };
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    file.write(reinterpret_cast<const char*>(signature), 8);
+    unsigned char header[13] = {0};
+    writeUint32(header, static_cast<uint32_t>(width));
+    writeUint32(header + 4, static_cast<uint32_t>(height));
+    header[8] = 8;
+    header[9] = 2;
+    writeChunk("IHDR", header, sizeof(header));
+    writeChunk("IDAT", compressed.data(), compressedSize);
+    writeChunk("IEND", nullptr, 0);
+    return file.good();
+}
+
+// Carrega cada grupo, aplica a mesma escala da janela e grava um PNG por passo.
+// Um grupo que falha e contado e os demais seguem.
+int runHeadless(float scaleFactor) {
+    if (!createHeadlessContext()) {
+        destroyHeadlessContext();
+        return -1;
+    }
+    if (!initGLEW() || !createHeadlessFramebuffer(headlessWidth, headlessHeight)) {
+        std::cerr << "OpenGL 3.0 framebuffers not available for offscreen rendering" << std::endl;
+        destroyHeadlessContext();
+        return -1;
+    }
+    if (bufferedRendering) {
+        initMeshBuffers();
+        instancedRendering = initInstancedRendering();
+    }
+    framebuffer_size_callback(nullptr, headlessWidth, headlessHeight);
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    // Grupos com o mesmo nome (a/part.obj e b/part.obj) gravariam as mesmas
+    // imagens: os repetidos ganham o numero do grupo no nome.
+    std::vector<std::string> usedNames;
+    for (size_t g = 0; g < sceneGroups.size(); ++g) {
+        std::string& name = sceneGroups[g].name;
+        while (std::find(usedNames.begin(), usedNames.end(), name) != usedNames.end()) {
+            name += "-" + std::to_string(g + 1);
+        }
+        usedNames.push_back(name);
+    }
+
+    std::vector<SceneObject> objects = sceneObjects;
+    std::vector<unsigned char> pixels(static_cast<size_t>(headlessWidth) * headlessHeight * 3);
+    size_t failures = 0;
+    for (const SceneGroup& group : sceneGroups) {
+        auto start = std::chrono::steady_clock::now();
+        auto first = objects.begin() + group.firstObject;
+        sceneObjects.assign(first, first + group.objectCount);
+        if (!loadScene()) {
+            ++failures;
+            continue;
+        }
+        scaleModel(scaleFactor);
+        compileTransformations();
+        int steps = static_cast<int>(transformations.size());
+        int step = -1;
+        for (; step < steps; ++step) {
+            currentTransformationIndex = step;
+            renderFrame();
+            glReadPixels(0, 0, headlessWidth, headlessHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+            std::string image = outputDirectory + "/" + group.name + "_" + std::to_string(step + 1) + ".png";
+            if (!writePNG(image, headlessWidth, headlessHeight, pixels)) {
+                std::cerr << "Failed to write image: " << image << std::endl;
+                ++failures;
+                break;
+            }
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Rendered " << step + 1 << " images of " << group.name << " in " << elapsed.count() << " ms"
+                  << std::endl;
+    }
+    destroyHeadlessContext();
+    return failures == 0 ? 0 : -1;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <file_path>" << std::endl;
+    bool badArguments = false;
+    bool benchParse = false;
+    bool benchNormals = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            parseThreads = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--bench-parse") {
+            benchParse = true;
+        } else if (arg == "--bench-normals") {
+            benchNormals = true;
+        } else if (arg == "--weld" && i + 1 < argc) {
+            weldEnabled = true;
+            weldEpsilon = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--verbosity" && i + 1 < argc) {
+            traceLevel = std::atoi(argv[++i]);
+        } else if (arg == "--no-simd") {
+            simdEnabled = false;
+        } else if (arg == "--no-cache") {
+            useMeshCache = false;
+        } else if (arg == "--immediate") {
+            bufferedRendering = false;
+        } else if (arg == "--no-cull") {
+            cullingEnabled = false;
+        } else if (arg == "--no-lod") {
+            lodEnabled = false;
+        } else if (arg == "--quantize") {
+            quantizeEnabled = true;
+        } else if (arg == "--scene" && i + 1 < argc) {
+            if (!readSceneFile(argv[++i])) {
+                return -1;
+            }
+        } else if (arg == "--headless") {
+            headlessMode = true;
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputDirectory = argv[++i];
+        } else if (arg.compare(0, 2, "--") != 0) {
+            sceneGroups.push_back({fileStem(arg), sceneObjects.size(), 0});
+            addSceneObject(arg);
+        } else {
+            badArguments = true;
+            break;
+        }
+    }
+    if (badArguments || sceneObjects.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [options] <file_path>...\n"
+                  << "  --scene FILE      load the objects and transformations listed in FILE\n"
+                  << "  --headless        render each file or scene to PNGs offscreen, one per step\n"
+                  << "  --output DIR      directory for the --headless images (default .)\n"
+                  << "  --threads N       parse with N threads (default: all cores)\n"
+                  << "  --weld EPS        merge vertices closer than EPS\n"
+                  << "  --no-cache        do not read or write the .p3d mesh cache\n"
+                  << "  --no-simd         use the scalar normal kernel\n"
+                  << "  --immediate       draw with glBegin/glEnd instead of vertex buffers\n"
+                  << "  --no-cull         submit every cluster, even when off screen\n"
+                  << "  --no-lod          always draw the full-resolution mesh\n"
+                  << "  --quantize        keep the GPU mesh in 16-bit positions and normals\n"
+                  << "  --verbosity 0-3   log level (default 1)\n"
+                  << "  --bench-parse     measure parse throughput per thread count and exit\n"
+                  << "  --bench-normals   measure the normal passes and exit" << std::endl;
         return 1;
     }
+    const char* path = sceneObjects[0].path.c_str();
+    if (benchParse) {
+        return benchmarkParse(path) ? 0 : -1;
+    }
+    if (benchNormals) {
+        return benchmarkNormals(path) ? 0 : -1;
+    }
+    float scaleFactor = 7.0;
+    if (headlessMode) {
+        return runHeadless(scaleFactor);
+    }
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW\n";
         return -1;
     }
 
-    if (!loadOBJ(argv[1])) {
+    if (!loadScene()) {
         return -1;
     }
+    printNormalMemoryReport();
+    std::cout << "Edges: " << edgeIndices.size() / 2 << " unique of " << triangles.size() * 3
+              << " triangle sides" << std::endl;
+    std::cout << "BVH: " << bvhNodes.size() << " nodes over " << triangles.size() << " triangles, "
+              << meshClusters.size() << " clusters" << std::endl;
+    // O ACMR da ordem lida so e conhecido quando a malha vem do .obj.
+    std::cout << "ACMR (cache of " << vertexCacheSize << "): ";
+    if (loadedACMR > 0.0) {
+        std::cout << loadedACMR << " as loaded, ";
+    }
+    std::cout << simulateACMR(drawTriangleOrder) << " as drawn" << std::endl;
     /*if (!loadOBJ("/home/kegure/CLionProjects/untitled4/DonutMaiara.obj")) {
         return -1;
     }*/
-    copyModel();
-
-    calculateFaceNormals();
-    calculateVertexNormals();
 
-    float scaleFactor = 7.0;
     scaleModel(scaleFactor);
     GLFWwindow* window = glfwCreateWindow(640, 480, "Visualizador 3D", NULL, NULL);
     if (!window) {
@@ -501,8 +5028,27 @@ int main(int argc, char* argv[]) {
         return -1;
     }
     printTransformations();
+    startTraceThread();
+    startLODBuild();
+    compileTransformations();
 
     glfwMakeContextCurrent(window);
+    if (bufferedRendering && !initGLEW()) {
+        std::cerr << "OpenGL 3.0 not available, falling back to immediate mode" << std::endl;
+        bufferedRendering = false;
+    }
+    if (bufferedRendering) {
+        initMeshBuffers();
+        instancedRendering = initInstancedRendering();
+        if (!instancedRendering) {
+            std::cerr << "Instanced shaders not available, drawing one view at a time" << std::endl;
+        }
+    }
+    if (quantizedRendering) {
+        printQuantizationReport();
+    } else if (quantizeEnabled && bufferedRendering) {
+        std::cerr << "Quantized vertices need the instanced shaders, uploading floats" << std::endl;
+    }
 
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
@@ -520,44 +5066,21 @@ int main(int argc, char* argv[]) {
 
 
     while (!glfwWindowShouldClose(window)) {
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        if (lightEnabled && currentDisplayMode == FILLED) {
-            glEnable(GL_LIGHTING);
-        } else {
-            glDisable(GL_LIGHTING);
-        }
-
-
-        glPushMatrix();
-        glRotatef(rotationX, 1.0f, 0.0f, 0.0f);
-        glRotatef(rotationY, 0.0f, 1.0f, 0.0f);
-
-        draw_axes();
-        setupMaterial();
-        if(currentTransformationIndex == -1 ){
-            glColor3f(0.0f, 0.0f, 1.0f); // Azul
-            drawModel(vertices, faces);
-        }
-
-
-
-        glPushMatrix();
-        if (currentTransformationIndex >= 0) {
-            applyTransformations(currentTransformationIndex - 1);
-            glColor3f(0.0f, 1.0f, 0.0f);
-            drawModel(previousTransformedVertices, previousTransformedFaces);
-        }
-        applyTransformations(currentTransformationIndex);
-        glColor3f(1.0f, 0.0f, 0.0f);
-        drawModel(transformedVertices, transformedFaces);
-
-        glPopMatrix();
-
-        glPopMatrix();
+        auto frameStart = std::chrono::steady_clock::now();
+        renderFrame();
 
         glfwSwapBuffers(window);
         glfwPollEvents();
+
+        std::chrono::duration<float, std::milli> frameTime = std::chrono::steady_clock::now() - frameStart;
+        traceEvent(TRACE_INFO, TRACE_FRAME, currentTransformationIndex, frameTime.count());
+        if (bufferedRendering) {
+            traceEvent(TRACE_INFO, TRACE_CULL, currentTransformationIndex, static_cast<float>(cullStats.visibleClusters),
+                       static_cast<float>(cullStats.clusters), static_cast<float>(cullStats.submittedTriangles));
+        }
     }
+    stopLODBuild();
+    stopTraceThread();
     glfwTerminate();
     return 0;
 }